@@ -0,0 +1,392 @@
+// Copyright 2006-2024 Mitchell. See LICENSE.
+// Command-line tool for highlighting files with Scintillua lexers and writing the result as
+// HTML or ANSI terminal escapes.
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+#include <algorithm>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <map>
+#include <memory>
+
+#if !_WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "ILexer.h"
+
+#include "Scintillua.h"
+#include "MemoryDocument.h"
+
+namespace {
+
+// The text of a file to highlight, memory-mapped if possible.
+class File {
+public:
+  explicit File(const char *filename) {
+#if !_WIN32
+    const int fd = open(filename, O_RDONLY);
+    if (fd == -1) return;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+      ok = true, length = st.st_size;
+      if (length > 0) {
+        void *map = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED)
+          mapped = static_cast<const char *>(map);
+        else
+          ok = false, length = 0;
+      }
+    }
+    close(fd);
+#else
+    FILE *f = fopen(filename, "rb");
+    if (!f) return;
+    char buf[BUFSIZ];
+    for (size_t n; (n = fread(buf, 1, sizeof(buf), f)) > 0;) contents.append(buf, n);
+    fclose(f);
+    ok = true, length = contents.size();
+#endif
+  }
+  ~File() {
+#if !_WIN32
+    if (mapped) munmap(const_cast<char *>(mapped), length);
+#endif
+  }
+  File(const File &) = delete;
+  File &operator=(const File &) = delete;
+
+  bool ok = false; // whether or not the file could be read
+  const char *Text() const { return mapped ? mapped : contents.c_str(); }
+  size_t Length() const { return length; }
+
+private:
+  const char *mapped = nullptr;
+  std::string contents; // used if the file is not mapped
+  size_t length = 0;
+};
+
+// Properties read from a theme's .properties file, like SciTE reads them.
+class Properties {
+public:
+  // Reads properties from the given file and returns whether or not it was successful.
+  bool Read(const char *filename) {
+    FILE *f = fopen(filename, "rb");
+    if (!f) return false;
+    char buf[BUFSIZ];
+    bool skipping = false; // whether or not in a false "if" block
+    for (std::string line; fgets(buf, sizeof(buf), f);) {
+      line.assign(buf);
+      while (!line.empty() && (line.back() == '\n' || line.back() == '\r')) line.pop_back();
+      const bool indented = !line.empty() && (line[0] == ' ' || line[0] == '\t');
+      line.erase(0, line.find_first_not_of(" \t"));
+      if (line.empty() || line[0] == '#') continue;
+      if (line.compare(0, 3, "if ") == 0) {
+#if _WIN32
+        skipping = line.substr(3) != "PLAT_WIN";
+#else
+        skipping = line.substr(3) != "PLAT_GTK";
+#endif
+        continue;
+      }
+      if (!indented) skipping = false;
+      if (skipping) continue;
+      if (const size_t eq = line.find('='); eq != std::string::npos)
+        props[line.substr(0, eq)] = line.substr(eq + 1);
+    }
+    fclose(f);
+    return true;
+  }
+
+  // Returns the value of the given property with any "$(name)" references expanded.
+  std::string Get(const std::string &key, int depth = 0) const {
+    auto it = props.find(key);
+    if (it == props.end()) return "";
+    std::string value = it->second;
+    for (size_t s = value.find("$("), e; s != std::string::npos && depth < 16;
+         s = value.find("$(", s)) {
+      if ((e = value.find(')', s)) == std::string::npos) break;
+      const std::string expanded = Get(value.substr(s + 2, e - s - 2), depth + 1);
+      value.replace(s, e - s + 1, expanded);
+      s += expanded.size();
+    }
+    return value;
+  }
+
+  bool Has(const std::string &key) const { return props.count(key) > 0; }
+
+private:
+  std::map<std::string, std::string> props;
+};
+
+// A style from a theme.
+struct Style {
+  std::string fore, back; // "#RRGGBB" colors or empty strings
+  bool bold = false, italics = false, underlined = false;
+};
+
+// Parses a style definition like "fore:#000000,back:#FFFFFF,bold".
+Style ParseStyle(std::string_view definition) {
+  Style style;
+  while (!definition.empty()) {
+    size_t comma = definition.find(',');
+    std::string_view token = definition.substr(0, comma);
+    definition.remove_prefix(comma == std::string_view::npos ? definition.size() : comma + 1);
+    while (!token.empty() && (token.front() == ' ' || token.front() == '\t'))
+      token.remove_prefix(1);
+    while (!token.empty() && (token.back() == ' ' || token.back() == '\t')) token.remove_suffix(1);
+    const auto isColor = [](std::string_view value) {
+      return value.size() == 7 && value[0] == '#';
+    };
+    if (token.compare(0, 5, "fore:") == 0 && isColor(token.substr(5)))
+      style.fore = token.substr(5);
+    else if (token.compare(0, 5, "back:") == 0 && isColor(token.substr(5)))
+      style.back = token.substr(5);
+    else if (token == "bold")
+      style.bold = true;
+    else if (token == "italics")
+      style.italics = true;
+    else if (token == "underlined")
+      style.underlined = true;
+  }
+  return style;
+}
+
+// Highlights files and writes their highlighted text.
+class Highlighter {
+public:
+  enum Format { HTML, ANSI };
+
+  Highlighter(const Properties &theme, Format format) : theme(theme), format(format) {
+    defaultStyle = ParseStyle(theme.Get("scintillua.styles.default"));
+  }
+  ~Highlighter() {
+    for (auto &[name, lexer] : lexers)
+      if (lexer.lexer) lexer.lexer->Release();
+    if (detector) detector->Release();
+  }
+
+  // Highlights the given file using the given lexer (or a detected one if *lexerName* is
+  // empty), writes the result to *out*, and returns whether or not it was successful. Errors
+  // are printed to stderr.
+  bool Highlight(const char *filename, std::string lexerName, FILE *out) {
+    File file{filename};
+    if (!file.ok) return (fprintf(stderr, "%s: cannot read file\n", filename), false);
+    if (lexerName.empty()) lexerName = Detect(filename, {file.Text(), file.Length()});
+    const Lexer *lexer = GetLexer(lexerName);
+    if (!lexer->lexer) return (fprintf(stderr, "%s: %s\n", filename, lexer->error.c_str()), false);
+
+    styles.resize(file.Length());
+    MemoryDocument document{file.Text(), static_cast<Sci_Position>(file.Length()), styles.data()};
+    if (file.Length() > 0) lexer->lexer->Lex(0, file.Length(), 0, &document);
+    if (const char *error = lexer->lexer->PropertyGet("lexer.scintillua.error"); *error) {
+      fprintf(stderr, "%s: %s\n", filename, error);
+      lexer->lexer->PropertySet("lexer.scintillua.error", "");
+      return false;
+    }
+    Write(*lexer, {file.Text(), file.Length()}, out);
+    return true;
+  }
+
+private:
+  const Properties &theme;
+  Format format;
+  Style defaultStyle;
+  // A lexer and the output for each of its styles, reused for all files of its language.
+  struct Lexer {
+    Scintilla::ILexer5 *lexer = nullptr; // nullptr if it could not be created
+    std::string error; // why the lexer could not be created
+    std::vector<std::string> starts, ends; // start and end markup for each style
+  };
+  std::map<std::string, Lexer> lexers;
+  Scintilla::ILexer5 *detector = nullptr; // for lexer.detect()
+  std::vector<char> styles; // reused for each file
+
+  // Returns the name of the lexer to use for the given file, or "text".
+  std::string Detect(const char *filename, std::string_view text) {
+    if (!detector && !(detector = CreateLexer("text"))) return "text";
+    const std::string line{text.substr(0, std::min(text.find_first_of("\r\n"), size_t{128}))};
+    detector->PropertySet("lexer.scintillua.filename", filename);
+    detector->PropertySet("lexer.scintillua.line", line.c_str());
+    const size_t len = reinterpret_cast<uintptr_t>(detector->PrivateCall(SCLUA_DETECT, nullptr));
+    if (len == 0) return "text";
+    std::string name(len, '\0');
+    detector->PrivateCall(SCLUA_DETECT, name.data());
+    return name;
+  }
+
+  // Returns the lexer for the given language, creating it if necessary.
+  const Lexer *GetLexer(const std::string &name) {
+    if (auto it = lexers.find(name); it != lexers.end()) return &it->second;
+    Lexer &lexer = lexers[name];
+    if (!(lexer.lexer = CreateLexer(name.c_str())))
+      return (lexer.error = GetCreateLexerError(), &lexer);
+    for (int i = 0; i < lexer.lexer->NamedStyles(); i++) {
+      const std::string styleName = lexer.lexer->NameOfStyle(i);
+      const auto [start, end] = Markup(StyleFor(styleName));
+      lexer.starts.push_back(start), lexer.ends.push_back(end);
+    }
+    return &lexer;
+  }
+
+  // Returns the theme's style for the given style name, falling back on its parent names (e.g.
+  // "whitespace" for "whitespace.lua").
+  Style StyleFor(std::string name) {
+    for (;;) {
+      if (const std::string key = "scintillua.styles." + name; theme.Has(key))
+        return name == "default" ? Style{} : ParseStyle(theme.Get(key));
+      const size_t dot = name.rfind('.');
+      if (dot == std::string::npos) return Style{};
+      name.erase(dot);
+    }
+  }
+
+  // Returns the start and end markup for the given style.
+  std::pair<std::string, std::string> Markup(const Style &style) const {
+    std::string start, end;
+    if (format == HTML) {
+      if (!style.fore.empty()) start.append("color:").append(style.fore).append(";");
+      if (!style.back.empty()) start.append("background-color:").append(style.back).append(";");
+      if (style.bold) start.append("font-weight:bold;");
+      if (style.italics) start.append("font-style:italic;");
+      if (style.underlined) start.append("text-decoration:underline;");
+      if (start.empty()) return {start, end};
+      start.pop_back(); // trailing ';'
+      return {"<span style=\"" + start + "\">", "</span>"};
+    }
+    const auto rgb = [](const std::string &color) {
+      return std::to_string(std::stoi(color.substr(1, 2), nullptr, 16)) + ";" +
+        std::to_string(std::stoi(color.substr(3, 2), nullptr, 16)) + ";" +
+        std::to_string(std::stoi(color.substr(5, 2), nullptr, 16));
+    };
+    if (!style.fore.empty()) start.append(";38;2;").append(rgb(style.fore));
+    if (!style.back.empty()) start.append(";48;2;").append(rgb(style.back));
+    if (style.bold) start.append(";1");
+    if (style.italics) start.append(";3");
+    if (style.underlined) start.append(";4");
+    if (start.empty()) return {start, end};
+    return {"\033[" + start.substr(1) + "m", "\033[0m"};
+  }
+
+  // Writes the given styled text as HTML or with ANSI escapes.
+  void Write(const Lexer &lexer, std::string_view text, FILE *out) const {
+    std::string output;
+    if (format == HTML) {
+      output.append("<pre");
+      std::string style;
+      if (!defaultStyle.fore.empty()) style.append("color:").append(defaultStyle.fore).append(";");
+      if (!defaultStyle.back.empty())
+        style.append("background-color:").append(defaultStyle.back).append(";");
+      if (!style.empty()) style.pop_back(), output.append(" style=\"").append(style).append("\"");
+      output.append(">");
+    }
+    for (size_t i = 0, end; i < text.size(); i = end) {
+      const auto style = static_cast<unsigned char>(styles[i]);
+      for (end = i + 1; end < text.size() && static_cast<unsigned char>(styles[end]) == style;)
+        end++;
+      const bool marked = style < lexer.starts.size() && !lexer.starts[style].empty();
+      if (marked) output.append(lexer.starts[style]);
+      if (format == HTML)
+        for (char ch : text.substr(i, end - i)) switch (ch) {
+          case '<': output.append("&lt;"); break;
+          case '>': output.append("&gt;"); break;
+          case '&': output.append("&amp;"); break;
+          default: output.push_back(ch);
+          }
+      else
+        output.append(text.substr(i, end - i));
+      if (marked) output.append(lexer.ends[style]);
+    }
+    if (format == HTML) output.append("</pre>\n");
+    fwrite(output.data(), 1, output.size(), out);
+  }
+};
+
+void PrintUsage(const char *program) {
+  fprintf(stderr,
+    "Usage: %s [options] [file ...]\n"
+    "Highlights files using Scintillua lexers. If no files are given, reads filenames from\n"
+    "stdin, one per line.\n\n"
+    "Options:\n"
+    "  -L dir     Scintillua's lexers directory (default: this program's directory)\n"
+    "  -t theme   theme .properties file (default: <dir>/../themes/scite.properties)\n"
+    "  -l lexer   lexer to use instead of detecting one for each file\n"
+    "  -f format  output format: 'html' (default) or 'ansi'\n"
+    "  -s suffix  write each file's output to the file's name plus suffix instead of stdout\n",
+    program);
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  std::string lexersDir, themeFile, lexerName, suffix;
+  Highlighter::Format format = Highlighter::HTML;
+  int i = 1;
+  for (; i < argc && argv[i][0] == '-' && argv[i][1]; i++) {
+    const std::string_view option{argv[i]};
+    if (option == "--") {
+      i++;
+      break;
+    }
+    if (option.size() != 2 || !strchr("Ltlfs", option[1]) || i + 1 == argc)
+      return (PrintUsage(argv[0]), 1);
+    const char *value = argv[++i];
+    switch (option[1]) {
+    case 'L': lexersDir = value; break;
+    case 't': themeFile = value; break;
+    case 'l': lexerName = value; break;
+    case 'f':
+      if (strcmp(value, "html") == 0)
+        format = Highlighter::HTML;
+      else if (strcmp(value, "ansi") == 0)
+        format = Highlighter::ANSI;
+      else
+        return (PrintUsage(argv[0]), 1);
+      break;
+    case 's': suffix = value; break;
+    }
+  }
+  if (lexersDir.empty()) {
+    lexersDir = argv[0];
+    const size_t slash = lexersDir.find_last_of("/\\");
+    lexersDir = slash != std::string::npos ? lexersDir.substr(0, slash) : ".";
+  }
+  if (themeFile.empty()) themeFile = lexersDir + "/../themes/scite.properties";
+
+  SetLibraryProperty("scintillua.lexers", lexersDir.c_str());
+  Properties theme;
+  if (!theme.Read(themeFile.c_str()))
+    return (fprintf(stderr, "%s: cannot read theme\n", themeFile.c_str()), 1);
+  Highlighter highlighter{theme, format};
+
+  int status = 0;
+  const auto highlight = [&](const char *filename) {
+    FILE *out = stdout;
+    if (!suffix.empty() && !(out = fopen((std::string{filename} + suffix).c_str(), "wb"))) {
+      fprintf(stderr, "%s%s: cannot write file\n", filename, suffix.c_str());
+      status = 1;
+      return;
+    }
+    if (!highlighter.Highlight(filename, lexerName, out)) status = 1;
+    if (out != stdout) fclose(out);
+  };
+  if (i < argc)
+    for (; i < argc; i++) highlight(argv[i]);
+  else {
+    char buf[4096];
+    for (std::string filename; fgets(buf, sizeof(buf), stdin);) {
+      filename.assign(buf);
+      while (!filename.empty() && (filename.back() == '\n' || filename.back() == '\r'))
+        filename.pop_back();
+      if (!filename.empty()) highlight(filename.c_str());
+    }
+  }
+  return status;
+}
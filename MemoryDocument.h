@@ -0,0 +1,162 @@
+// Copyright 2006-2024 Mitchell. See LICENSE.
+// In-memory Scintilla documents shared by Scintillua, its command-line tools, and its tests.
+
+#ifndef MEMORYDOCUMENT_H
+#define MEMORYDOCUMENT_H
+
+#include <cstring>
+
+#include <algorithm>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "ILexer.h"
+
+#include "Scintilla.h"
+
+// An in-memory document for lexing text outside of Scintilla, as LexDocuments() and the
+// command-line highlighter do. Positions are bytes, and lines end in "\r", "\n", or "\r\n".
+class MemoryDocument : public Scintilla::IDocument {
+public:
+  MemoryDocument(const char *text, Sci_Position length, char *styles)
+      : text(text), length(length), styles(styles) {
+    FindLineStarts();
+    lineStates.assign(lineStarts.size(), 0);
+    levels.assign(lineStarts.size(), SC_FOLDLEVELBASE);
+    if (length > 0) memset(styles, 0, length);
+  }
+  virtual ~MemoryDocument() = default;
+
+  int SCI_METHOD Version() const override { return Scintilla::dvRelease4; }
+  void SCI_METHOD SetErrorStatus(int) override {}
+  Sci_Position SCI_METHOD Length() const override { return length; }
+  void SCI_METHOD GetCharRange(
+    char *buffer, Sci_Position position, Sci_Position lengthRetrieve) const override {
+    memcpy(buffer, text + position, lengthRetrieve);
+  }
+  char SCI_METHOD StyleAt(Sci_Position position) const override {
+    return position >= 0 && position < length ? styles[position] : 0;
+  }
+  Sci_Position SCI_METHOD LineFromPosition(Sci_Position position) const override {
+    return std::upper_bound(lineStarts.begin(), lineStarts.end(), position) - lineStarts.begin() -
+      1;
+  }
+  Sci_Position SCI_METHOD LineStart(Sci_Position line) const override {
+    if (line < 0) return 0;
+    return line < static_cast<Sci_Position>(lineStarts.size()) ? lineStarts[line] : length;
+  }
+  int SCI_METHOD GetLevel(Sci_Position line) const override {
+    return ValidLine(line) ? levels[line] : SC_FOLDLEVELBASE;
+  }
+  int SCI_METHOD SetLevel(Sci_Position line, int level) override {
+    return ValidLine(line) ? (levels[line] = level) : SC_FOLDLEVELBASE;
+  }
+  int SCI_METHOD GetLineState(Sci_Position line) const override {
+    return ValidLine(line) ? lineStates[line] : 0;
+  }
+  int SCI_METHOD SetLineState(Sci_Position line, int state) override {
+    return ValidLine(line) ? (lineStates[line] = state) : 0;
+  }
+  void SCI_METHOD StartStyling(Sci_Position position) override { stylingPos = position; }
+  bool SCI_METHOD SetStyleFor(Sci_Position lengthStyle, char style) override {
+    if (stylingPos < 0 || stylingPos + lengthStyle > length) return false;
+    memset(styles + stylingPos, style, lengthStyle), stylingPos += lengthStyle;
+    return true;
+  }
+  bool SCI_METHOD SetStyles(Sci_Position lengthStyles, const char *newStyles) override {
+    if (stylingPos < 0 || stylingPos + lengthStyles > length) return false;
+    memcpy(styles + stylingPos, newStyles, lengthStyles), stylingPos += lengthStyles;
+    return true;
+  }
+  void SCI_METHOD DecorationSetCurrentIndicator(int) override {}
+  void SCI_METHOD DecorationFillRange(Sci_Position, int, Sci_Position) override {}
+  void SCI_METHOD ChangeLexerState(Sci_Position, Sci_Position) override {}
+  int SCI_METHOD CodePage() const override { return 0; }
+  bool SCI_METHOD IsDBCSLeadByte(char) const override { return false; }
+  const char *SCI_METHOD BufferPointer() override { return text; }
+  int SCI_METHOD GetLineIndentation(Sci_Position line) override {
+    int indent = 0;
+    for (Sci_Position i = LineStart(line); i < length && (text[i] == ' ' || text[i] == '\t'); i++)
+      indent = text[i] == '\t' ? (indent / 8 + 1) * 8 : indent + 1;
+    return indent;
+  }
+  Sci_Position SCI_METHOD LineEnd(Sci_Position line) const override {
+    Sci_Position end = LineStart(line + 1);
+    if (end > LineStart(line) && end <= length && text[end - 1] == '\n') end--;
+    if (end > LineStart(line) && end <= length && text[end - 1] == '\r') end--;
+    return end;
+  }
+  Sci_Position SCI_METHOD GetRelativePosition(
+    Sci_Position positionStart, Sci_Position characterOffset) const override {
+    const Sci_Position position = positionStart + characterOffset;
+    return position >= 0 && position <= length ? position : -1;
+  }
+  int SCI_METHOD GetCharacterAndWidth(Sci_Position position, Sci_Position *pWidth) const override {
+    if (pWidth) *pWidth = 1;
+    return position >= 0 && position < length ? static_cast<unsigned char>(text[position]) : 0;
+  }
+
+protected:
+  const char *text;
+  Sci_Position length;
+  char *styles;
+  std::vector<Sci_Position> lineStarts;
+  std::vector<int> lineStates, levels;
+  Sci_Position stylingPos = 0;
+
+  // Finds the start position of each line in the text.
+  void FindLineStarts() {
+    lineStarts.assign(1, 0);
+    for (Sci_Position i = 0; i < length; i++)
+      if (text[i] == '\n' || (text[i] == '\r' && (i + 1 == length || text[i + 1] != '\n')))
+        lineStarts.push_back(i + 1);
+  }
+  bool ValidLine(Sci_Position line) const {
+    return line >= 0 && line < static_cast<Sci_Position>(lineStarts.size());
+  }
+};
+
+// The text and styles of an EditableDocument, which must exist before its MemoryDocument.
+struct DocumentBuffer {
+  explicit DocumentBuffer(std::string text)
+      : contents(std::move(text)), styleBytes(contents.size()) {}
+  std::string contents;
+  std::vector<char> styleBytes;
+};
+
+// A MemoryDocument that owns its text and can be edited like Scintilla's, keeping the styles,
+// line states, and fold levels of unedited text, as the native tests and benchmarks do.
+// Inserted text is unstyled.
+class EditableDocument : private DocumentBuffer, public MemoryDocument {
+public:
+  explicit EditableDocument(std::string text)
+      : DocumentBuffer{std::move(text)},
+        MemoryDocument{contents.data(), static_cast<Sci_Position>(contents.size()),
+          styleBytes.data()} {}
+
+  const std::string &Text() const { return contents; }
+  const std::vector<char> &Styles() const { return styleBytes; }
+
+  // Replaces *deleted* bytes at position *pos* with *inserted*, and returns the start of the
+  // line the edit was made on.
+  Sci_Position Replace(Sci_Position pos, Sci_Position deleted, const std::string &inserted) {
+    const Sci_Position line = LineFromPosition(pos);
+    const Sci_Position linesDeleted = LineFromPosition(pos + deleted) - line;
+    const size_t lineCount = lineStarts.size();
+    contents.replace(pos, deleted, inserted);
+    styleBytes.erase(styleBytes.begin() + pos, styleBytes.begin() + pos + deleted);
+    styleBytes.insert(styleBytes.begin() + pos, inserted.size(), 0);
+    text = contents.data(), length = contents.size(), styles = styleBytes.data();
+    FindLineStarts();
+    // Like Scintilla, lines split from the edited line start with its line state and level.
+    const Sci_Position linesInserted = lineStarts.size() - lineCount + linesDeleted;
+    for (auto *values : {&lineStates, &levels}) {
+      values->erase(values->begin() + line + 1, values->begin() + line + 1 + linesDeleted);
+      values->insert(values->begin() + line + 1, linesInserted, (*values)[line]);
+    }
+    return LineStart(line);
+  }
+};
+
+#endif
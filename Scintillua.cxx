@@ -1,13 +1,30 @@
 // Copyright 2006-2024 Mitchell. See LICENSE.
 
 #include <cassert>
+#include <cctype>
+#include <climits>
+#include <cstdint>
+#include <cstdlib>
+#include <cstdio>
 #include <cstring>
 
+#include <algorithm>
+#include <chrono>
+#include <functional>
 #include <string>
 #include <string_view>
 #include <vector>
 #include <map>
+#include <set>
+#include <unordered_map>
 #include <memory>
+#include <new>
+#include <optional>
+#include <utility>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <sys/stat.h>
 
 #include "ILexer.h"
 
@@ -19,6 +36,7 @@
 #include "DefaultLexer.h"
 
 #include "Scintillua.h"
+#include "MemoryDocument.h"
 
 extern "C" {
 #include "lua.h"
@@ -29,15 +47,532 @@ LUALIB_API int luaopen_lpeg(lua_State *L);
 
 namespace {
 
+// A run of text lexed by a Lua lexer.
+struct StyleRun {
+  int style;
+  Sci_PositionU end; // 1-based position after the run
+};
+
+// A Lua allocator that pools the small blocks that lexing mostly allocates (strings, tables,
+// closures, and userdata), counts the bytes in use, and optionally limits them.
+// Small blocks are carved out of large chunks and recycled through free lists by size class
+// instead of being individually allocated from and returned to the system. Since Lua passes
+// the size of a block when resizing or freeing it, blocks need no headers. Chunks whose blocks
+// have all been freed are released by Trim() once enough pooled memory is free, and the rest
+// are freed along with the allocator.
+// Allocations are only made while the owning host is locked, but counts may be read without
+// the lock.
+class LuaAllocator {
+public:
+  LuaAllocator() = default;
+  LuaAllocator(const LuaAllocator &) = delete;
+  LuaAllocator &operator=(const LuaAllocator &) = delete;
+  ~LuaAllocator() {
+    while (chunks) free(std::exchange(chunks, chunks->prev));
+  }
+
+  // The lua_Alloc function for allocator *ud*.
+  static void *Alloc(void *ud, void *ptr, size_t osize, size_t nsize) {
+    return static_cast<LuaAllocator *>(ud)->Realloc(ptr, ptr ? osize : 0, nsize);
+  }
+
+  // Releases the chunks whose blocks are all free if more than TrimThreshold bytes of blocks
+  // are, so that memory used while lexing a large range is not kept for good.
+  void Trim();
+
+  std::atomic<size_t> current{0}, peak{0}; // bytes in use by Lua
+  std::atomic<size_t> limit{0}; // maximum bytes in use, or 0 for no limit; set by LockHost()
+  bool exceeded = false; // whether or not an allocation failed because of the limit
+  // Whether or not the limit applies. It only does inside protected_call(), since a memory
+  // error outside of a protected call would make Lua abort.
+  bool enforced = false;
+
+private:
+  static constexpr size_t Granularity = 16; // also the alignment of pooled blocks
+  static constexpr size_t MaxPooled = 256;
+  static constexpr size_t ChunkSize = 64 * 1024;
+  static constexpr size_t TrimThreshold = 16 * ChunkSize;
+  struct Block {
+    Block *next;
+  };
+  struct alignas(Granularity) Chunk {
+    Chunk *prev;
+    size_t carved = 0; // bytes of blocks carved out of the chunk
+    size_t freed = 0; // bytes of those blocks that are free, as counted by Trim()
+  };
+  Block *freeLists[MaxPooled / Granularity] = {}; // indexed by size class
+  Chunk *chunks = nullptr; // the most recently allocated chunk
+  char *chunkPos = nullptr, *chunkEnd = nullptr; // unused space in the current chunk
+  size_t freeBytes = 0; // bytes of blocks in the free lists
+
+  static size_t SizeClass(size_t size) { return (size - 1) / Granularity; }
+  void *AllocPooled(size_t size);
+  void FreePooled(void *ptr, size_t size);
+  void *Realloc(void *ptr, size_t osize, size_t nsize);
+};
+
+void *LuaAllocator::AllocPooled(size_t size) {
+  const size_t blockSize = (SizeClass(size) + 1) * Granularity;
+  if (Block *&list = freeLists[SizeClass(size)]; list)
+    return (freeBytes -= blockSize, std::exchange(list, list->next));
+  if (static_cast<size_t>(chunkEnd - chunkPos) < blockSize) {
+    // Note: any unused space in the previous chunk is abandoned.
+    auto chunk = static_cast<Chunk *>(malloc(ChunkSize));
+    if (!chunk) return nullptr;
+    new (chunk) Chunk{std::exchange(chunks, chunk)};
+    chunkPos = reinterpret_cast<char *>(chunk + 1);
+    chunkEnd = reinterpret_cast<char *>(chunk) + ChunkSize;
+  }
+  chunks->carved += blockSize;
+  return std::exchange(chunkPos, chunkPos + blockSize);
+}
+
+void LuaAllocator::FreePooled(void *ptr, size_t size) {
+  Block *&list = freeLists[SizeClass(size)];
+  list = new (ptr) Block{list};
+  freeBytes += (SizeClass(size) + 1) * Granularity;
+}
+
+void LuaAllocator::Trim() {
+  if (freeBytes < TrimThreshold) return;
+  // Count the free bytes in each chunk, finding a block's chunk by address.
+  std::vector<Chunk *> sorted;
+  for (Chunk *chunk = chunks; chunk; chunk = chunk->prev) sorted.push_back(chunk), chunk->freed = 0;
+  std::sort(sorted.begin(), sorted.end());
+  const auto chunkOf = [&](Block *block) {
+    const auto after = std::upper_bound(sorted.begin(), sorted.end(), static_cast<void *>(block),
+      [](void *ptr, Chunk *chunk) { return std::less<void *>{}(ptr, chunk); });
+    return *(after - 1);
+  };
+  for (size_t i = 0; i < MaxPooled / Granularity; i++)
+    for (Block *block = freeLists[i]; block; block = block->next)
+      chunkOf(block)->freed += (i + 1) * Granularity;
+  // Unlink the blocks of chunks that are entirely free (except for the current chunk, which may
+  // still have blocks carved out of it), and release those chunks.
+  const auto released = [&](Chunk *chunk) {
+    return chunk != chunks && chunk->freed == chunk->carved;
+  };
+  for (size_t i = 0; i < MaxPooled / Granularity; i++)
+    for (Block **block = &freeLists[i]; *block;)
+      if (released(chunkOf(*block)))
+        *block = (*block)->next, freeBytes -= (i + 1) * Granularity;
+      else
+        block = &(*block)->next;
+  for (Chunk **chunk = &chunks; *chunk;)
+    if (released(*chunk))
+      free(std::exchange(*chunk, (*chunk)->prev));
+    else
+      chunk = &(*chunk)->prev;
+}
+
+void *LuaAllocator::Realloc(void *ptr, size_t osize, size_t nsize) {
+  if (nsize == 0) {
+    if (ptr) osize <= MaxPooled ? FreePooled(ptr, osize) : free(ptr);
+    current.store(current.load(std::memory_order_relaxed) - osize, std::memory_order_relaxed);
+    return nullptr;
+  }
+  const size_t used = current.load(std::memory_order_relaxed) - osize + nsize;
+  if (const size_t max = limit.load(std::memory_order_relaxed);
+    enforced && max && nsize > osize && used > max)
+    return (exceeded = true, nullptr);
+  void *block = ptr;
+  if (ptr && osize > MaxPooled && nsize > MaxPooled) {
+    if (!(block = realloc(ptr, nsize))) return nullptr;
+  } else if (!ptr || osize > MaxPooled || nsize > MaxPooled ||
+    SizeClass(osize) != SizeClass(nsize)) {
+    // Move the block into or out of the pool, or between size classes.
+    if (!(block = nsize <= MaxPooled ? AllocPooled(nsize) : malloc(nsize))) return nullptr;
+    if (ptr) {
+      memcpy(block, ptr, std::min(osize, nsize));
+      osize <= MaxPooled ? FreePooled(ptr, osize) : free(ptr);
+    }
+  }
+  current.store(used, std::memory_order_relaxed);
+  if (used > peak.load(std::memory_order_relaxed)) peak.store(used, std::memory_order_relaxed);
+  return block;
+}
+
+// Prints an error raised outside of a protected call before Lua aborts, like luaL_newstate()'s
+// panic function does.
+// Note: the memory limit does not apply outside of protected calls, so only a real lack of
+// memory should get here.
+int lua_panic(lua_State *L) {
+  fprintf(stderr, "PANIC: unprotected error in call to Lua API (%s)\n", lua_tostring(L, -1));
+  return 0;
+}
+
+// Calls lua_pcall() with the Lua state's memory limit in effect, so that exceeding it raises
+// an error that can be logged, and trims the Lua state's allocator after the outermost call.
+int protected_call(lua_State *L, int nargs, int nresults, int msgh) {
+  void *ud;
+  lua_getallocf(L, &ud);
+  auto &allocator = *static_cast<LuaAllocator *>(ud);
+  const bool enforced = std::exchange(allocator.enforced, true);
+  const int status = lua_pcall(L, nargs, nresults, msgh);
+  allocator.enforced = enforced;
+  if (!enforced) allocator.Trim();
+  return status;
+}
+
+class Scintillua;
+
+// The names of lexer.lua's default tags followed by its predefined styles, in style number
+// order. Every lexer has these tags and styles, and their 1-based tag ids from lexer._tag_id()
+// are their 1-based style numbers.
+constexpr const char *FixedTags[] = {"whitespace", "comment", "string", "number", "keyword",
+  "identifier", "operator", "error", "preprocessor", "constant", "variable", "function", "class",
+  "type", "label", "regex", "embedded", "function.builtin", "constant.builtin",
+  "function.method", "tag", "attribute", "variable.builtin", "heading", "bold", "italic",
+  "underline", "code", "link", "reference", "annotation", "list", "default", "line.number",
+  "brace.light", "brace.bad", "control.char", "indent.guide", "call.tip", "fold.display.text"};
+constexpr int FixedTagCount = sizeof(FixedTags) / sizeof(*FixedTags);
+static_assert(std::string_view{FixedTags[STYLE_DEFAULT]} == "default");
+static_assert(std::string_view{FixedTags[STYLE_LASTPREDEFINED]} == "fold.display.text");
+
+// A loaded Lua lexer and its compiled grammar.
+// All Scintillua instances of the same language share a single host, so only the first
+// instance pays for loading the lexer and compiling its grammar. Instances with different word
+// lists update the host's word lists in place before using it.
+// Per-document state like properties, line states, and fold levels is not kept here.
+struct LexerHost {
+  std::string key; // key in the hosts map
+  LuaAllocator allocator; // must outlive L
+  std::unique_ptr<lua_State, decltype(&lua_close)> L{
+    lua_newstate(LuaAllocator::Alloc, &allocator), lua_close};
+  // Instances that share this host may be used from different threads, so they must hold this
+  // lock while using its Lua state.
+  std::mutex mutex;
+  bool multilang = false;
+  // The word lists set by instances that the Lua lexer currently has (none for the lexer's own),
+  // the lexer's own word lists that those replaced, and the version of the instance word lists
+  // last applied.
+  std::vector<std::optional<std::string>> wordLists;
+  std::map<size_t, std::string> ownWordLists;
+  uint64_t wordListsVersion = 0;
+  // Whether or not the lexer's state at a line start is fully determined by its Checkpoint,
+  // so Lex() may stop early once that state is unchanged.
+  bool completeLineState = false;
+  // The list of style numbers considered to be whitespace styles. Lexers only tag line endings
+  // with them outside of tokens, and multilang lexers use the current language's, so lexing can
+  // resume at any line start whose previous line ends in one.
+  bool ws[STYLE_MAX] = {};
+  // Properties set by the Lua lexer itself (e.g. "scintillua.comment"). Instances that share
+  // this host copy them into their own properties.
+  std::map<std::string, std::string> lexerProps;
+  // Style runs emitted by lexer._emit() during the current Lex() call.
+  std::vector<StyleRun> runs;
+  int emitStyle = STYLE_DEFAULT; // style of the tag most recently emitted
+  // Names of the tags given ids by lexer._tag_id() that are not in FixedTags (the first has id
+  // FixedTagCount + 1), and their style numbers in the Lua lexer, or -1 if not yet resolved.
+  std::vector<std::string> tagNames;
+  std::vector<int> tagStyles;
+  // The Lua lexer's number of styles and the names of those not in FixedTags, read once by
+  // LoadStyles() so that style names can be looked up without Lua.
+  int numStyles = 0;
+  std::vector<std::string> styleNames;
+  // Returns the name of style number *style*, or "Unknown". The host must be locked, and the
+  // name is only valid until the next Scintillua::LoadStyles().
+  const char *StyleName(int style) const {
+    if (style >= 0 && style < FixedTagCount) return FixedTags[style];
+    const size_t i = style - FixedTagCount;
+    return style >= 0 && i < styleNames.size() ? styleNames[i].c_str() : "Unknown";
+  }
+  // The instance using this host and the document and 0-based start position of the text it
+  // is lexing or folding, for the lexer.fold_level, lexer.style_at, etc. accessors. When
+  // lexing line by line, lexer.line_from_position() positions are relative to the current
+  // line, which starts lineOffset bytes after startPos.
+  struct Context {
+    Scintillua *lexer = nullptr;
+    Scintilla::IDocument *buffer = nullptr;
+    Sci_PositionU startPos = 0;
+    Sci_PositionU lineOffset = 0;
+  } context;
+  // Cache of emitted tag name strings to styles. Cached strings are kept in the
+  // REGISTRY.emitted_tags table so their addresses cannot be reused by other strings.
+  std::unordered_map<const void *, int> nameStyles;
+  // Statistics recorded while the "lexer.scintillua.profile" property is set. The Lua lexer
+  // records per-rule statistics in lexer._profile.
+  struct Timing {
+    size_t calls = 0;
+    size_t bytes = 0; // total size of the ranges given
+    size_t processed = 0; // bytes lexed or folded, excluding those whose styles or levels were kept
+    double seconds = 0;
+  };
+  bool profiling = false;
+  Timing lexTiming, foldTiming;
+  // The Lua lexer's fold points and options, read on first fold.
+  struct FoldPoints {
+    bool loaded = false;
+    bool exist = false; // whether or not the lexer has any fold points
+    bool functions = false; // whether or not any fold point is a function
+    bool caseInsensitive = false;
+    bool byIndentation = false;
+    std::vector<std::string> symbols; // in order of precedence
+    std::vector<bool> wordSymbols; // whether or not each symbol is a word
+    bool firstBytes[256] = {}; // whether or not a symbol starts with a byte
+    // The level of each symbol for each style. A level may instead be a function (stored in
+    // REGISTRY.fold_functions) or absent.
+    enum Kind { None, Level, Function };
+    struct Point {
+      Kind kind = None;
+      int value = 0; // level or function index
+    };
+    std::vector<Point> points; // points[style * symbols.size() + symbol]
+  } foldPoints;
+
+  ~LexerHost();
+};
+
+// Map of host groups, lexers directories, and lexer names to loaded lexers.
+std::map<std::string, std::weak_ptr<LexerHost>> hosts;
+std::mutex hostsMutex; // guards hosts
+// The last version given to a Scintillua instance's word lists.
+std::atomic<uint64_t> lastWordListsVersion{0};
+
+LexerHost::~LexerHost() {
+  std::lock_guard<std::mutex> lock{hostsMutex};
+  if (auto it = hosts.find(key); it != hosts.end() && it->second.expired()) hosts.erase(it);
+}
+
+// Reads the given file into *text* and returns whether or not it was successful.
+bool ReadFile(const char *filename, std::string &text) {
+  FILE *f = fopen(filename, "rb");
+  if (!f) return false;
+  char buf[BUFSIZ];
+  for (size_t n; (n = fread(buf, 1, sizeof(buf), f)) > 0;) text.append(buf, n);
+  fclose(f);
+  return true;
+}
+
+// Returns the 32-bit FNV-1a hash of the given text.
+uint32_t Hash(std::string_view text) {
+  uint32_t hash = 2166136261u;
+  for (unsigned char ch : text) hash = (hash ^ ch) * 16777619u;
+  return hash;
+}
+
+// Identifies a version of a file on disk by its modification time and size.
+struct FileStamp {
+  long long mtime = -1, size = -1; // -1 if the file does not exist
+  bool operator==(const FileStamp &other) const {
+    return mtime == other.mtime && size == other.size;
+  }
+};
+
+// Returns the stamp of the given file.
+FileStamp StampFile(const char *filename) {
+  struct stat st;
+  if (stat(filename, &st) != 0) return {};
+  return {static_cast<long long>(st.st_mtime), static_cast<long long>(st.st_size)};
+}
+
+// A Lua source file read by a host.
+struct Source {
+  std::string text;
+  uint32_t hash; // for checking against precompiled chunks
+  FileStamp stamp; // the file's stamp when it was read
+};
+
+// A bundle of precompiled lexers ("lexers.bundle") in a lexers directory, as generated by
+// gen_bundle.lua. It starts with a "scintillua bundle 1" line, followed by an index of
+// "name source_size source_hash offset size" lines, a blank line, and then the chunks.
+struct Bundle {
+  struct Chunk {
+    size_t sourceSize;
+    uint32_t sourceHash; // a chunk is only used if its source is unchanged
+    size_t offset, size; // in data
+  };
+  std::map<std::string, Chunk, std::less<>> chunks; // by lexer name
+  using Iterator = decltype(chunks)::const_iterator;
+  std::string data;
+  FileStamp stamp; // the file's stamp when it was read
+};
+
+// Caches of Lua source files read by hosts, keyed by filename, and bundles, keyed by
+// directory (with no chunks if a directory has no bundle). Hosts load lexers from these
+// shared, immutable copies instead of reading them from disk again, unless a file has changed
+// since it was read.
+std::map<std::string, std::shared_ptr<const Source>, std::less<>> sources;
+std::map<std::string, std::shared_ptr<const Bundle>, std::less<>> bundles;
+std::mutex sourcesMutex; // guards sources and bundles
+
+// Returns the cached source of the given file, reading it again if it has changed, or nullptr
+// if it cannot be read.
+std::shared_ptr<const Source> GetSource(const char *filename) {
+  const FileStamp stamp = StampFile(filename);
+  {
+    std::lock_guard<std::mutex> lock{sourcesMutex};
+    if (auto it = sources.find(filename); it != sources.end() && it->second->stamp == stamp)
+      return it->second;
+  }
+  auto source = std::make_shared<Source>();
+  if (!ReadFile(filename, source->text)) return nullptr;
+  source->hash = Hash(source->text), source->stamp = stamp;
+  std::lock_guard<std::mutex> lock{sourcesMutex};
+  return sources.insert_or_assign(filename, std::move(source)).first->second;
+}
+
+// Returns the cached bundle in the given directory, reading it again if it has changed, or
+// nullptr if there is none.
+std::shared_ptr<const Bundle> GetBundle(std::string_view dir) {
+  const std::string filename = std::string{dir} + "/lexers.bundle";
+  const FileStamp stamp = StampFile(filename.c_str());
+  {
+    std::lock_guard<std::mutex> lock{sourcesMutex};
+    if (auto it = bundles.find(dir); it != bundles.end() && it->second->stamp == stamp)
+      return it->second->chunks.empty() ? nullptr : it->second;
+  }
+  auto bundle = std::make_shared<Bundle>();
+  bundle->stamp = stamp;
+  std::string text;
+  constexpr std::string_view header = "scintillua bundle 1\n";
+  size_t pos = header.size(), eol;
+  if (ReadFile(filename.c_str(), text) && text.compare(0, header.size(), header) == 0) {
+    while ((eol = text.find('\n', pos)) != std::string::npos && eol > pos) {
+      char name[128];
+      unsigned long sourceSize, sourceHash, offset, size;
+      if (sscanf(text.c_str() + pos, "%127s %lu %lu %lu %lu", name, &sourceSize, &sourceHash,
+            &offset, &size) == 5)
+        bundle->chunks[name] = {sourceSize, static_cast<uint32_t>(sourceHash), offset, size};
+      pos = eol + 1;
+    }
+    if (eol != std::string::npos) bundle->data = text.substr(eol + 1);
+    for (auto it = bundle->chunks.begin(); it != bundle->chunks.end();)
+      if (it->second.offset + it->second.size > bundle->data.size())
+        it = bundle->chunks.erase(it); // truncated
+      else
+        ++it;
+  }
+  std::lock_guard<std::mutex> lock{sourcesMutex};
+  bundles.insert_or_assign(std::string{dir}, bundle);
+  return bundle->chunks.empty() ? nullptr : bundle;
+}
+
+// Loads the given Lua file like luaL_loadfilex() does, but from the shared source cache.
+// If the file's directory has a bundle with an up-to-date precompiled chunk for it, loads that
+// chunk instead so that the file does not have to be parsed.
+int LoadSource(lua_State *L, const char *filename, const char *mode) {
+  const auto source = GetSource(filename);
+  if (!source) return (lua_pushfstring(L, "cannot open %s", filename), LUA_ERRFILE);
+  const std::string chunkname = std::string{"@"} + filename;
+
+  const std::string_view path{filename};
+  const size_t slash = path.find_last_of("/\\");
+  std::string_view name = path.substr(slash + 1); // npos + 1 == 0
+  if (name.size() > 4 && name.substr(name.size() - 4) == ".lua") name.remove_suffix(4);
+  const auto bundle = GetBundle(slash != std::string_view::npos ? path.substr(0, slash) : ".");
+  if (const auto it = bundle ? bundle->chunks.find(name) : Bundle::Iterator{};
+      bundle && it != bundle->chunks.end() && it->second.sourceSize == source->text.size() &&
+      it->second.sourceHash == source->hash) {
+    // Note: the chunk is binary even if *mode* only allows text, since it matches the source.
+    const char *chunk = bundle->data.data() + it->second.offset;
+    if (luaL_loadbufferx(L, chunk, it->second.size, chunkname.c_str(), "b") == LUA_OK)
+      return LUA_OK;
+    lua_pop(L, 1); // error message (e.g. from a different version of Lua); load the source
+  }
+  return luaL_loadbufferx(L, source->text.data(), source->text.size(), chunkname.c_str(), mode);
+}
+
+// A set of words for lexer.word_match() that LPeg can match against without creating Lua
+// strings. Words are stored in an open addressing hash table, folded to lower case if the set
+// is case-insensitive.
+class WordSet {
+public:
+  WordSet(bool caseInsensitive, std::string_view extraChars) : caseInsensitive{caseInsensitive} {
+    Clear(extraChars);
+  }
+
+  // Removes all words and replaces any extra word characters, keeping case-sensitivity.
+  void Clear(std::string_view extraChars) {
+    for (int c = 0; c < 256; c++)
+      wordChars[c] = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+        c == '_';
+    for (unsigned char c : extraChars) wordChars[c] = true;
+    words.clear(), slots.clear();
+    minLen = SIZE_MAX, maxLen = 0;
+  }
+
+  void Add(std::string_view word) {
+    if (word.empty()) return;
+    std::string &s = words.emplace_back(word);
+    if (caseInsensitive)
+      for (char &c : s) c = Fold(c);
+    minLen = std::min(minLen, s.size()), maxLen = std::max(maxLen, s.size());
+    if (2 * words.size() > slots.size()) Rehash();
+    else Insert(words.size() - 1);
+  }
+
+  // Returns the length of the word at the start of the given text if it is in this set, or 0.
+  // Like lexer.word_match(), the entire run of word characters must be a word.
+  size_t Match(const char *text, size_t len) const {
+    size_t n = 0;
+    while (n < len && n <= maxLen && wordChars[static_cast<unsigned char>(text[n])]) n++;
+    if (n < minLen || n > maxLen) return 0;
+    const size_t mask = slots.size() - 1;
+    for (size_t i = Hash(text, n) & mask; slots[i]; i = (i + 1) & mask) {
+      const std::string &word = words[slots[i] - 1];
+      if (word.size() == n && Equal(word.data(), text, n)) return n;
+    }
+    return 0;
+  }
+
+private:
+  bool caseInsensitive;
+  bool wordChars[256];
+  std::vector<std::string> words;
+  std::vector<size_t> slots; // 1-based indices into words, or 0 for an empty slot
+  size_t minLen = SIZE_MAX, maxLen = 0;
+
+  static char Fold(char c) { return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c; }
+
+  size_t Hash(const char *s, size_t len) const {
+    size_t h = 2166136261u; // FNV-1a
+    for (size_t i = 0; i < len; i++)
+      h = (h ^ static_cast<unsigned char>(caseInsensitive ? Fold(s[i]) : s[i])) * 16777619u;
+    return h;
+  }
+
+  bool Equal(const char *word, const char *text, size_t len) const {
+    if (!caseInsensitive) return memcmp(word, text, len) == 0;
+    for (size_t i = 0; i < len; i++)
+      if (word[i] != Fold(text[i])) return false;
+    return true;
+  }
+
+  void Insert(size_t index) {
+    const size_t mask = slots.size() - 1;
+    size_t i = Hash(words[index].data(), words[index].size()) & mask;
+    while (slots[i]) i = (i + 1) & mask;
+    slots[i] = index + 1;
+  }
+
+  void Rehash() {
+    slots.assign(std::max<size_t>(16, slots.size() * 2), 0);
+    for (size_t i = 0; i < words.size(); i++) Insert(i);
+  }
+};
+
+constexpr const char *WordSetMetatable = "scintillua.wordset";
+
+// Read-only view of buffer text that Lua code can treat like a string without it being copied.
+// A view is only valid for the duration of the call it is passed to.
+struct BufferView {
+  const char *text;
+  size_t len;
+};
+
+constexpr const char *BufferViewMetatable = "scintillua.bufferview";
+
 class Scintillua : public Lexilla::DefaultLexer {
   std::string name;
-  std::unique_ptr<lua_State, decltype(&lua_close)> L; // cleared when lexer language changes
+  std::string lexersDir;
+  int group; // instances in different host groups never share hosts
+  std::shared_ptr<LexerHost> host;
+  lua_State *L = nullptr; // host->L
   Lexilla::PropSetSimple props;
-  bool multilang = false;
-  // The list of style numbers considered to be whitespace styles.
-  // This is used in multi-language lexers when backtracking to whitespace to determine which
-  // lexer grammar to use.
-  bool ws[STYLE_MAX];
+  size_t memoryLimit = 0; // maximum bytes the host's Lua state may use, or 0 for no limit
+  std::vector<std::optional<std::string>> wordLists; // set by WordListSet(), or none if unset
+  uint64_t wordListsVersion = 0; // unique to wordLists, or 0 if none were set
   std::string privateCallResult; // used by PrivateCall for persistence
   std::string wordListsDescription; // used by DescribeWordListSets() for persistence
   std::string styleName; // used by NameOfStyle() for persistence
@@ -46,6 +581,7 @@ class Scintillua : public Lexilla::DefaultLexer {
   struct Placeholder {
     std::string s;
     bool b;
+    int i;
   };
   Placeholder placeholder;
   struct PropertyDoc : public Lexilla::OptionSet<Placeholder> {
@@ -57,10 +593,106 @@ class Scintillua : public Lexilla::DefaultLexer {
   // the stack. Error messages are logged to the LexerErrorKey property.
   void LogError(const char *str = nullptr, bool print = true);
 
+  // Returns the hosts map key for this lexer's host group and language.
+  std::string HostKey() const;
+  // Locks this lexer's host, if any, for the duration of a call that uses its Lua state.
+  // Its memory limit is this lexer's while locked.
+  std::unique_lock<std::mutex> LockHost() {
+    if (!host) return std::unique_lock<std::mutex>{};
+    std::unique_lock<std::mutex> lock{host->mutex};
+    host->allocator.limit = memoryLimit;
+    return lock;
+  }
+  // Loads this lexer's language into a new host, applying any word lists, and returns whether
+  // or not it was successful. Errors are logged.
+  bool LoadHost();
+  // Calls the Lua lexer's set_word_list() for 0-based word list number *n* and returns whether
+  // or not it was successful. Errors are logged.
+  bool SetWordList(int n, const char *wl);
+  // Updates the host's Lua lexer in place to have this instance's word lists, unless it already
+  // does, and returns whether or not it was successful. The host must be locked, and errors
+  // are logged.
+  bool ApplyWordLists();
+  // Reads the Lua lexer's style names into its host, and resolves the style numbers of its
+  // host's tag ids. The host must be locked.
+  void LoadStyles();
+
+  // Hashes of the text of each line as of the last Lex(), or 0 for lines not lexed or edited
+  // since then. Lex() keeps them in step with lines added or deleted.
+  std::vector<uint32_t> lineHashes;
+  // Returns whether or not the text between line start positions *pos* and *end* is a line
+  // whose text and styles are the same as when it was last lexed.
+  bool LineUnchanged(Lexilla::LexAccessor &styler, Scintilla::IDocument *buffer, Sci_PositionU pos,
+    Sci_PositionU end);
+  // When the current Lex() must stop if lexer.scintillua.budget.ms is set, and the line start
+  // it stopped at after exceeding that budget, or 0 if it styled its entire range.
+  std::chrono::steady_clock::time_point lexDeadline = std::chrono::steady_clock::time_point::max();
+  Sci_PositionU lexStop = 0;
+  // The start of the text whose styles the last Lex() kept because they could not have
+  // changed, or 0. Fold() may stop there once fold levels are also unchanged.
+  Sci_PositionU unchangedPos = 0;
+  bool OverBudget() const { return std::chrono::steady_clock::now() >= lexDeadline; }
+  // The lexer's state at the start of a line, as recorded by the document's styles and line
+  // states. It is resumable if its style is a whitespace style.
+  struct Checkpoint {
+    int style; // style at the end of the previous line
+    int wsStyle; // the whitespace style of the current language, if known
+    int lineState; // line state of the previous line
+    bool operator==(const Checkpoint &other) const {
+      return style == other.style && wsStyle == other.wsStyle && lineState == other.lineState;
+    }
+  };
+  // Returns the lexer's state at line start position *pos*.
+  Checkpoint CheckpointAt(Lexilla::LexAccessor &styler, Sci_PositionU pos);
+  // Returns the nearest line at or before line *line* whose start lexing can resume from, and
+  // sets *style* to the style to resume lexing with.
+  Sci_Position ResumeAt(Lexilla::LexAccessor &styler, Sci_Position line, int &style);
+  // Reads the Lua lexer's fold points and options into its host.
+  void LoadFoldPoints();
+  // Calculates fold levels for the given range of text like lexer.fold() does, appending
+  // (line, level) pairs to *folds*, and returns whether or not it was successful. Errors are
+  // logged.
+  bool FoldText(Lexilla::LexAccessor &styler, Sci_PositionU startPos, Sci_Position lengthDoc,
+    Scintilla::IDocument *buffer, std::vector<std::pair<Sci_Position, int>> &folds);
+  bool FoldByFoldPoints(Lexilla::LexAccessor &styler, Sci_PositionU startPos,
+    std::string_view text, Sci_Position startLine, int startLevel,
+    std::vector<std::pair<Sci_Position, int>> &folds);
+  void FoldByIndentation(std::string_view text, Sci_Position startLine, int startLevel,
+    Scintilla::IDocument *buffer, std::vector<std::pair<Sci_Position, int>> &folds);
+  // Lexes and styles the given range of text, which starts at a line start lexing can resume
+  // from with style *initStyle*, and returns whether or not it was successful. Errors are
+  // logged, and the range is styled with *initStyle*.
+  bool LexRange(Lexilla::LexAccessor &styler, Sci_PositionU startPos, Sci_Position lengthDoc,
+    int initStyle, Scintilla::IDocument *buffer);
+  // Lexes the given range of text line by line like lexer.lex() does for lexers with the
+  // lex_by_line option, appending to the host's style runs, and returns whether or not it was
+  // successful. The lexer is on the top of the stack, and errors are left there.
+  bool LexLines(Lexilla::LexAccessor &styler, Sci_PositionU startPos, Sci_Position lengthDoc,
+    int initStyle, Scintilla::IDocument *buffer);
+  // Lexes and styles the given range of text in bounded windows like LexRange() does, so that
+  // neither the text passed to the Lua lexer nor its style runs grow with the size of the range.
+  bool LexWindows(Lexilla::LexAccessor &styler, Sci_PositionU startPos, Sci_Position lengthDoc,
+    int initStyle, Scintilla::IDocument *buffer);
+  // Sets or clears field *field* of the Lua lexer module, and clears the Lua lexer's compiled
+  // grammar so that it is rebuilt with the option that field enables. The host must be locked.
+  void SetGrammarOption(const char *field, bool enable);
+  // Starts or stops profiling this lexer's host, discarding any previous statistics.
+  void SetProfiling(bool enable);
+  // Returns a report of this lexer's host's profiling statistics, or an empty string if it is
+  // not profiling.
+  std::string ProfileStats();
+
 public:
   static constexpr const char *LexerErrorKey = "lexer.scintillua.error";
-
-  Scintillua(const std::string &lexersDir, const char *name);
+  static constexpr const char *ProfileKey = "lexer.scintillua.profile";
+  static constexpr const char *StatsKey = "lexer.scintillua.stats";
+  static constexpr const char *DispatchKey = "lexer.scintillua.dispatch";
+  static constexpr const char *MemoryLimitKey = "lexer.scintillua.memory.limit";
+  static constexpr const char *MemoryCurrentKey = "lexer.scintillua.memory.current";
+  static constexpr const char *MemoryPeakKey = "lexer.scintillua.memory.peak";
+
+  // Instances in different host groups do not share hosts, so they can lex in parallel.
+  Scintillua(const std::string &lexersDir, const char *name, int group = 0);
   virtual ~Scintillua() override = default;
 
   void SCI_METHOD Release() override;
@@ -91,6 +723,14 @@ public:
   const char *SCI_METHOD PropertyGet(const char *key) override;
 
   const char *SCI_METHOD GetName() override;
+
+  // Sets a property on behalf of the Lua lexer, and remembers it for other instances that share
+  // this lexer's host.
+  void SetLexerProperty(const char *key, const char *value);
+
+  // Detects the lexers of the given files with the Lua lexer's detect_all(), storing lexer names
+  // in *names*, and returns the number of files a lexer was detected for. Errors are logged.
+  size_t DetectLexers(ScintilluaFile *files, size_t count, std::set<std::string> &names);
 };
 
 // Ensures that the Lua stack contains the same number of stack values at the beginning and
@@ -105,6 +745,24 @@ private:
   int top;
 };
 
+// Adds the duration of a Lex() or Fold() call and the size of its range to the given host
+// statistics, if any.
+class ProfileTimer {
+public:
+  ProfileTimer(LexerHost::Timing *timing, Sci_Position length) : timing(timing) {
+    if (timing) timing->calls++, timing->bytes += length;
+  }
+  ~ProfileTimer() {
+    if (!timing) return;
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    timing->seconds += elapsed.count();
+  }
+
+private:
+  LexerHost::Timing *timing;
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+};
+
 Scintillua::PropertyDoc::PropertyDoc() {
   DefineProperty(LexerErrorKey, &Placeholder::s, "Error message from most recent operation.");
   DefineProperty("fold", &Placeholder::b, "Enable folding.");
@@ -116,134 +774,490 @@ Scintillua::PropertyDoc::PropertyDoc() {
     "else {').");
   DefineProperty(
     "fold.scintillua.compact", &Placeholder::b, "Include in a fold any subsequent blank lines.");
+  DefineProperty("lexer.scintillua.window", &Placeholder::i,
+    "The number of bytes to lex at a time when styling large ranges. Windows end at line starts "
+    "and are widened as needed. The default is 1048576. 0 lexes ranges all at once.");
+  DefineProperty("lexer.scintillua.budget.ms", &Placeholder::i,
+    "The number of milliseconds a single Lex() call may take before it stops at a line start "
+    "and leaves the rest of its range unstyled for a later call. The default is 0, for no "
+    "limit.");
+  DefineProperty(ProfileKey, &Placeholder::b,
+    "Record how often each lexer rule is attempted and matched, the number of bytes it matches, "
+    "and the time spent in it, along with the time spent in each Lex() and Fold() call. Setting "
+    "this property discards any previous statistics. Profiling applies to all lexers for the "
+    "same language, not just this one.");
+  DefineProperty(StatsKey, &Placeholder::s,
+    "A read-only report of the statistics recorded while lexer.scintillua.profile is set.");
+  DefineProperty(MemoryLimitKey, &Placeholder::i,
+    "The maximum number of bytes the Lua lexer may use. Lexing or folding that needs more fails "
+    "with an error. The default is 0, for no limit.");
+  DefineProperty(MemoryCurrentKey, &Placeholder::s,
+    "A read-only number of bytes the Lua lexer currently uses.");
+  DefineProperty(MemoryPeakKey, &Placeholder::s,
+    "A read-only number of bytes the Lua lexer has used at most.");
+  DefineProperty(DispatchKey, &Placeholder::b,
+    "Only try the lexer rules that could match the next byte, based on the bytes each rule can "
+    "start with. This applies to all lexers for the same language, not just this one.");
   DefineProperty("lexer.scintillua.filename", &Placeholder::s,
     "The filename for detecting a lexer via PrivateCall.");
   DefineProperty("lexer.scintillua.line", &Placeholder::s,
     "The content line for detecting a lexer via PrivateCall.");
+  DefineProperty("lexer.scintillua.detect.cache", &Placeholder::b,
+    "Keep the index for detecting lexers in memory instead of rebuilding it for each detection.");
 }
 
 void Scintillua::LogError(const char *str, bool print) {
-  const char *value = str ? str : lua_tostring(L.get(), -1);
+  const char *value = str ? str : lua_tostring(L, -1);
+  std::string message;
+  if (host && std::exchange(host->allocator.exceeded, false) && !str && value &&
+    strcmp(value, "not enough memory") == 0)
+    value = (message = std::string{value} + " (" + MemoryLimitKey + " reached)").c_str();
   PropertySet(LexerErrorKey, value);
   if (print) fprintf(stderr, "Lua Error: %s.\n", value);
-  lua_settop(L.get(), 0);
+  if (L) lua_settop(L, 0);
 }
 
+// RAII for host context fields.
+template <typename T> class ContextField {
+  T &field;
+  T prev;
+
+public:
+  ContextField(T &field, T value) : field{field}, prev{std::exchange(field, value)} {}
+  ContextField(const ContextField &) = delete;
+  ContextField &operator=(const ContextField &) = delete;
+  ~ContextField() { field = prev; }
+};
+
 // Lua xpcall error handler that appends traceback.
 int lua_error_handler(lua_State *L) { return (luaL_traceback(L, L, lua_tostring(L, -1), 1), 1); }
 
-// lexer.field[key] metamethod.
-int lexer_field_index(lua_State *L) {
-  const std::string_view field{lua_tostring(L, lua_upvalueindex(1))};
-  lua_getfield(L, LUA_REGISTRYINDEX, "scintillua"); // REGISTRY.scintillua
-  const auto scintillua = reinterpret_cast<Scintillua *>(lua_touserdata(L, -1));
-  lua_getfield(L, LUA_REGISTRYINDEX, "buffer"); // assume it's available too
-  const auto buffer = static_cast<Scintilla::IDocument *>(lua_touserdata(L, -1));
-  if (field == "fold_level") {
-    if (!buffer) luaL_error(L, "must be lexing or folding");
-    lua_pushinteger(L, buffer->GetLevel(luaL_checkinteger(L, 2) - 1)); // incoming line is 1-based
-  } else if (field == "indent_amount") {
-    if (!buffer) luaL_error(L, "must be lexing or folding");
-    lua_pushinteger(L, buffer->GetLineIndentation(luaL_checkinteger(L, 2) - 1)); // 1-based line
-  } else if (field == "property" || field == "property_int") {
-    lua_pushstring(L, scintillua->PropertyGet(luaL_checkstring(L, 2)));
-    if (field == "property_int") lua_pushinteger(L, lua_tointeger(L, -1));
-  } else if (field == "style_at") {
-    if (!buffer) luaL_error(L, "must be lexing or folding");
-    const Sci_PositionU startPos =
-      (lua_getfield(L, LUA_REGISTRYINDEX, "startPos"), lua_tointeger(L, -1)); // REGISTRY.startPos
-    const int style = buffer->StyleAt(startPos + luaL_checkinteger(L, 2) - 1); // 1-based position
-    lua_pushstring(L, scintillua->NameOfStyle(style));
-  } else if (field == "line_state") {
-    if (!buffer) luaL_error(L, "must be lexing or folding");
-    lua_pushinteger(L, buffer->GetLineState(luaL_checkinteger(L, 2) - 1)); // 1-based line
+// loadfile(filename, mode, env) replacement that loads files from the shared source cache.
+int lexer_loadfile(lua_State *L) {
+  const char *filename = luaL_checkstring(L, 1);
+  const char *mode = luaL_optstring(L, 2, nullptr);
+  const bool hasEnv = !lua_isnone(L, 3);
+  if (LoadSource(L, filename, mode) != LUA_OK) return (lua_pushnil(L), lua_insert(L, -2), 2);
+  if (hasEnv) {
+    lua_pushvalue(L, 3);
+    if (!lua_setupvalue(L, -2, 1)) lua_pop(L, 1); // set the chunk's _ENV
   }
   return 1;
 }
 
-// lexer.field[key] = value metamethod.
-int lexer_field_newindex(lua_State *L) {
-  const std::string_view field{lua_tostring(L, lua_upvalueindex(1))};
-  luaL_argcheck(L,
-    field != "fold_level" && field != "indent_amount" && field != "property_int" &&
-      field != "style_at" && field != "line_from_position",
-    3, "read-only field");
-  lua_getfield(L, LUA_REGISTRYINDEX, "scintillua"); // REGISTRY.scintillua
-  const auto lexer = reinterpret_cast<Scintillua *>(lua_touserdata(L, -1));
-  if (field == "property") {
-    if (strncmp(lua_tostring(L, 2), "scintillua.comment.", strlen("scintillua.comment.")) != 0) {
-      static constexpr const char *validKeys[] = {
-        "scintillua.comment", "scintillua.angle.braces", "scintillua.word.chars"};
-      luaL_checkoption(L, 2, nullptr, validKeys);
+// lexer._clock() function for profiling lexer rules.
+// Returns a monotonic time in seconds.
+int lexer_clock(lua_State *L) {
+  const std::chrono::duration<double> now = std::chrono::steady_clock::now().time_since_epoch();
+  return (lua_pushnumber(L, now.count()), 1);
+}
+
+// Returns the style number in the Lua lexer of host *host*'s 1-based tag id *id*, resolving
+// it by name if necessary.
+int tag_style(lua_State *L, LexerHost *host, lua_Integer id) {
+  if (id <= FixedTagCount) return static_cast<int>(id) - 1; // styles are 0-based
+  const size_t i = id - FixedTagCount - 1;
+  auto &styles = host->tagStyles;
+  if (i < styles.size() && styles[i] >= 0) return styles[i];
+  if (i >= host->tagNames.size()) return STYLE_DEFAULT;
+  int style = STYLE_DEFAULT;
+  lua_getfield(L, LUA_REGISTRYINDEX, "lex"), lua_getfield(L, -1, "_TAGS"); // lex._TAGS
+  if (lua_getfield(L, -1, host->tagNames[i].c_str()) == LUA_TNUMBER) // lex._TAGS[tag]
+    style = lua_tointeger(L, -1) - 1; // returned styles are 1-based
+  lua_pop(L, 3); // lex._TAGS[tag], lex._TAGS, lex
+  if (i >= styles.size()) styles.resize(host->tagNames.size(), -1);
+  return (styles[i] = style);
+}
+
+// lexer._tag_id(name) function for lexer.tag().
+// Returns the 1-based id of tag name *name*, creating one if necessary. Ids are the same for
+// all lexers in a host, and lexer._emit() maps them to styles without looking up names.
+int lexer_tag_id(lua_State *L) {
+  const auto host = static_cast<LexerHost *>(lua_touserdata(L, lua_upvalueindex(1)));
+  const char *name = luaL_checkstring(L, 1);
+  for (int i = 0; i < FixedTagCount; i++)
+    if (strcmp(name, FixedTags[i]) == 0) return (lua_pushinteger(L, i + 1), 1);
+  auto &names = host->tagNames;
+  size_t i = std::find(names.begin(), names.end(), name) - names.begin();
+  if (i == names.size()) names.emplace_back(name);
+  return (lua_pushinteger(L, FixedTagCount + i + 1), 1);
+}
+
+// lexer._emit(offset, value) fold function for lexer.lex().
+// Lexers' captures are alternating tags and positions. Instead of collecting them into a
+// table for Lex() to convert, append them directly to the host's style runs. Tags are
+// negated tag ids from lexer._tag_id(), or tag names (e.g. from lexer.token()).
+int lexer_emit(lua_State *L) {
+  const auto host = static_cast<LexerHost *>(lua_touserdata(L, lua_upvalueindex(1)));
+  if (lua_type(L, 2) == LUA_TSTRING) {
+    const void *tag = lua_tostring(L, 2);
+    auto it = host->nameStyles.find(tag);
+    if (it == host->nameStyles.end()) {
+      // Names built at match time may be collected, so keep this one while it is cached.
+      if (lua_getfield(L, LUA_REGISTRYINDEX, "emitted_tags") != LUA_TTABLE) {
+        lua_pop(L, 1), lua_newtable(L);
+        lua_pushvalue(L, -1), lua_setfield(L, LUA_REGISTRYINDEX, "emitted_tags");
+      }
+      lua_pushvalue(L, 2), lua_pushboolean(L, 1);
+      lua_rawset(L, -3), lua_pop(L, 1); // REGISTRY.emitted_tags[tag] = true
+      int style = STYLE_DEFAULT;
+      lua_getfield(L, LUA_REGISTRYINDEX, "lex"), lua_getfield(L, -1, "_TAGS"); // lex._TAGS
+      lua_pushvalue(L, 2);
+      if (lua_rawget(L, -2)) // lex._TAGS[tag]
+        style = lua_tointeger(L, -1) - 1; // returned styles are 1-based
+      lua_pop(L, 3); // lex._TAGS[tag], lex._TAGS, lex
+      it = host->nameStyles.emplace(tag, style).first;
     }
-    lexer->PropertySet(luaL_checkstring(L, 2), luaL_checkstring(L, 3));
-  } else if (field == "line_state") {
-    if (lua_getfield(L, LUA_REGISTRYINDEX, "buffer") != LUA_TLIGHTUSERDATA) // REGISTRY.buffer
-      luaL_error(L, "must be lexing or folding");
-    const auto buffer = static_cast<Scintilla::IDocument *>(lua_touserdata(L, -1));
-    const Sci_Position line = luaL_checkinteger(L, 2) - 1; // incoming line is 1-based
-    buffer->SetLineState(line, luaL_checkinteger(L, 3));
+    host->emitStyle = it->second;
+  } else if (const lua_Integer value = luaL_checkinteger(L, 2); value < 0) {
+    host->emitStyle = tag_style(L, host, -value);
+  } else {
+    const Sci_PositionU end = lua_tointeger(L, 1) + value;
+    if (host->runs.empty() || end > host->runs.back().end) // ignore empty runs
+      host->runs.push_back({host->emitStyle, end});
+  }
+  return (lua_settop(L, 1), 1); // offset
+}
+
+// Match-time function for lpeg.P() that matches a word in its WordSet upvalue.
+int word_set_match(lua_State *L) {
+  const auto set = static_cast<const WordSet *>(lua_touserdata(L, lua_upvalueindex(1)));
+  size_t len;
+  const char *subject = lua_tolstring(L, 1, &len);
+  const lua_Integer pos = lua_tointeger(L, 2);
+  const size_t n = set->Match(subject + pos - 1, len - (pos - 1)); // pos is 1-based
+  return (n ? lua_pushinteger(L, pos + n) : lua_pushboolean(L, false), 1);
+}
+
+// Adds the words in the list at stack index *index* to WordSet *set*.
+void word_set_add(lua_State *L, int index, WordSet *set) {
+  size_t len;
+  for (lua_Integer i = 1; lua_rawgeti(L, index, i) != LUA_TNIL; i++) { // for _, word in ipairs(t)
+    const char *word = lua_tolstring(L, -1, &len);
+    if (word) set->Add({word, len});
+    lua_pop(L, 1); // word
   }
+  lua_pop(L, 1); // nil
+}
+
+// lexer._word_matcher(words, case_insensitive, extra_chars) function for lexer.word_match().
+// Returns a match-time function for lpeg.P() that matches a word in list *words*, where word
+// characters are alphanumerics, '_', and *extra_chars*.
+int lexer_word_matcher(lua_State *L) {
+  luaL_checktype(L, 1, LUA_TTABLE);
+  size_t len;
+  const char *extraChars = luaL_optlstring(L, 3, "", &len);
+  auto set = new (lua_newuserdata(L, sizeof(WordSet)))
+    WordSet{lua_toboolean(L, 2) != 0, {extraChars, len}};
+  luaL_setmetatable(L, WordSetMetatable);
+  word_set_add(L, 1, set);
+  lua_pushcclosure(L, word_set_match, 1);
+  return 1;
+}
+
+// lexer._set_words(matcher, words, extra_chars) function for lexer.set_word_list().
+// Replaces the words and extra word characters of the set that *matcher*, a function returned
+// by lexer._word_matcher(), matches. The grammar that uses *matcher* does not change.
+int lexer_set_words(lua_State *L) {
+  luaL_checktype(L, 1, LUA_TFUNCTION);
+  luaL_checktype(L, 2, LUA_TTABLE);
+  size_t len;
+  const char *extraChars = luaL_optlstring(L, 3, "", &len);
+  lua_getupvalue(L, 1, 1);
+  auto set = static_cast<WordSet *>(luaL_testudata(L, -1, WordSetMetatable));
+  luaL_argcheck(L, set, 1, "word matcher expected");
+  set->Clear({extraChars, len});
+  word_set_add(L, 2, set);
+  return 0;
+}
+
+// __gc metamethod for WordSet.
+int word_set_gc(lua_State *L) {
+  static_cast<WordSet *>(lua_touserdata(L, 1))->~WordSet();
   return 0;
 }
 
+// Returns the BufferView at stack index *index*, raising an error if it is no longer valid.
+BufferView *check_buffer_view(lua_State *L, int index) {
+  auto view = static_cast<BufferView *>(luaL_checkudata(L, index, BufferViewMetatable));
+  if (!view->text) luaL_error(L, "buffer view is no longer valid");
+  return view;
+}
+
+// Converts string.sub()-style position *pos* into a 1-based position in text of length *len*.
+lua_Integer buffer_view_pos(lua_Integer pos, size_t len) {
+  if (pos >= 0) return pos;
+  return (0u - static_cast<size_t>(pos) > len) ? 0 : static_cast<lua_Integer>(len) + pos + 1;
+}
+
+// view:sub(i, j) function, analogous to string.sub().
+int buffer_view_sub(lua_State *L) {
+  const auto view = check_buffer_view(L, 1);
+  lua_Integer i = buffer_view_pos(luaL_checkinteger(L, 2), view->len);
+  lua_Integer j = buffer_view_pos(luaL_optinteger(L, 3, -1), view->len);
+  if (i < 1) i = 1;
+  if (j > static_cast<lua_Integer>(view->len)) j = view->len;
+  if (i > j) return (lua_pushliteral(L, ""), 1);
+  return (lua_pushlstring(L, view->text + i - 1, j - i + 1), 1);
+}
+
+// view:byte(i, j) function, analogous to string.byte().
+int buffer_view_byte(lua_State *L) {
+  const auto view = check_buffer_view(L, 1);
+  lua_Integer i = buffer_view_pos(luaL_optinteger(L, 2, 1), view->len);
+  lua_Integer j = buffer_view_pos(luaL_optinteger(L, 3, i), view->len);
+  if (i < 1) i = 1;
+  if (j > static_cast<lua_Integer>(view->len)) j = view->len;
+  if (i > j) return 0;
+  const int n = static_cast<int>(j - i + 1);
+  luaL_checkstack(L, n, "string slice too long");
+  for (int k = 0; k < n; k++) lua_pushinteger(L, static_cast<unsigned char>(view->text[i + k - 1]));
+  return n;
+}
+
+// view:len() function and #view metamethod.
+int buffer_view_len(lua_State *L) {
+  return (lua_pushinteger(L, check_buffer_view(L, 1)->len), 1);
+}
+
+// Replaces the BufferView at stack index *index* with a Lua string copy of its text.
+// The copy is made at most once per view.
+void buffer_view_materialize(lua_State *L, int index) {
+  index = lua_absindex(L, index);
+  const auto view = check_buffer_view(L, index);
+  if (lua_getuservalue(L, index) != LUA_TSTRING) {
+    lua_pop(L, 1); // nil
+    lua_pushlstring(L, view->text, view->len);
+    lua_pushvalue(L, -1), lua_setuservalue(L, index);
+  }
+  lua_replace(L, index);
+}
+
+// Calls the string library function in the first upvalue with a materialized view.
+int buffer_view_string_method(lua_State *L) {
+  buffer_view_materialize(L, 1);
+  lua_pushvalue(L, lua_upvalueindex(1)), lua_insert(L, 1);
+  lua_call(L, lua_gettop(L) - 1, LUA_MULTRET);
+  return lua_gettop(L);
+}
+
+// Pushes a new BufferView of the given text onto the stack and returns it. The caller must
+// invalidate it by clearing its text once the call it is passed to returns.
+BufferView *push_buffer_view(lua_State *L, const char *text, size_t len) {
+  auto view = new (lua_newuserdata(L, sizeof(BufferView))) BufferView{text, len};
+  return (luaL_setmetatable(L, BufferViewMetatable), view);
+}
+
+// view[key] metamethod.
+// Methods other than sub(), byte(), and len() fall back on their string library counterparts.
+int buffer_view_index(lua_State *L) {
+  const std::string_view key{luaL_checkstring(L, 2)};
+  if (key == "sub")
+    lua_pushcfunction(L, buffer_view_sub);
+  else if (key == "byte")
+    lua_pushcfunction(L, buffer_view_byte);
+  else if (key == "len")
+    lua_pushcfunction(L, buffer_view_len);
+  else {
+    lua_getfield(L, LUA_REGISTRYINDEX, "_LOADED"), lua_getfield(L, -1, "string");
+    lua_pushvalue(L, 2);
+    if (lua_rawget(L, -2) != LUA_TFUNCTION) return (lua_pushnil(L), 1); // string[key]
+    lua_pushcclosure(L, buffer_view_string_method, 1);
+  }
+  return 1;
+}
+
+// view .. value and value .. view metamethod.
+int buffer_view_concat(lua_State *L) {
+  for (int i = 1; i <= 2; i++)
+    if (luaL_testudata(L, i, BufferViewMetatable)) buffer_view_materialize(L, i);
+  return (lua_concat(L, 2), 1);
+}
+
+// tostring(view) metamethod.
+int buffer_view_tostring(lua_State *L) { return (buffer_view_materialize(L, 1), 1); }
+
+// Returns the host in the first upvalue of the current accessor function.
+LexerHost *accessor_host(lua_State *L) {
+  return static_cast<LexerHost *>(lua_touserdata(L, lua_upvalueindex(1)));
+}
+
+// Returns the host context of the current accessor function.
+LexerHost::Context *accessor_context(lua_State *L) { return &accessor_host(L)->context; }
+
+// Returns the document being lexed or folded, raising an error if there is none.
+Scintilla::IDocument *accessor_buffer(lua_State *L) {
+  const auto buffer = accessor_context(L)->buffer;
+  if (!buffer) luaL_error(L, "must be lexing or folding");
+  return buffer;
+}
+
+// lexer.fold_level[line] metamethod.
+// Note: line numbers from Lua are 1-based.
+int fold_level_index(lua_State *L) {
+  return (lua_pushinteger(L, accessor_buffer(L)->GetLevel(luaL_checkinteger(L, 2) - 1)), 1);
+}
+
+// lexer.indent_amount[line] metamethod.
+int indent_amount_index(lua_State *L) {
+  const Sci_Position line = luaL_checkinteger(L, 2) - 1; // incoming line is 1-based
+  return (lua_pushinteger(L, accessor_buffer(L)->GetLineIndentation(line)), 1);
+}
+
+// lexer.line_state[line] metamethod.
+int line_state_index(lua_State *L) {
+  return (lua_pushinteger(L, accessor_buffer(L)->GetLineState(luaL_checkinteger(L, 2) - 1)), 1);
+}
+
+// lexer.line_state[line] = state metamethod.
+int line_state_newindex(lua_State *L) {
+  const Sci_Position line = luaL_checkinteger(L, 2) - 1; // incoming line is 1-based
+  return (accessor_buffer(L)->SetLineState(line, luaL_checkinteger(L, 3)), 0);
+}
+
+// Returns the 0-based style number at 1-based position argument 2 of the text being lexed or
+// folded.
+int accessor_style_at(lua_State *L) {
+  const auto buffer = accessor_buffer(L);
+  const Sci_PositionU pos = accessor_context(L)->startPos + luaL_checkinteger(L, 2) - 1;
+  return static_cast<unsigned char>(buffer->StyleAt(pos));
+}
+
+// lexer.style_at[pos] metamethod.
+int style_at_index(lua_State *L) {
+  return (lua_pushstring(L, accessor_host(L)->StyleName(accessor_style_at(L))), 1);
+}
+
+// lexer.style_number_at[pos] metamethod.
+// Style numbers are 1-based like those in lex._TAGS.
+int style_number_at_index(lua_State *L) {
+  return (lua_pushinteger(L, accessor_style_at(L) + 1), 1);
+}
+
+// lexer.property[key] and lexer.property_int[key] metamethod.
+// The second upvalue is whether or not to convert the property to an integer.
+int property_index(lua_State *L) {
+  const char *key = luaL_checkstring(L, 2);
+  // Note: reading statistics requires the host lock, which is already held.
+  if (strcmp(key, Scintillua::StatsKey) == 0) luaL_error(L, "cannot read %s while lexing", key);
+  lua_pushstring(L, accessor_context(L)->lexer->PropertyGet(key));
+  if (lua_toboolean(L, lua_upvalueindex(2))) lua_pushinteger(L, lua_tointeger(L, -1));
+  return 1;
+}
+
+// lexer.property[key] = value metamethod.
+int property_newindex(lua_State *L) {
+  if (strncmp(luaL_checkstring(L, 2), "scintillua.comment.", strlen("scintillua.comment.")) != 0) {
+    static constexpr const char *validKeys[] = {
+      "scintillua.comment", "scintillua.angle.braces", "scintillua.word.chars"};
+    luaL_checkoption(L, 2, nullptr, validKeys);
+  }
+  accessor_context(L)->lexer->SetLexerProperty(luaL_checkstring(L, 2), luaL_checkstring(L, 3));
+  return 0;
+}
+
+// Read-only accessor[key] = value metamethod.
+int accessor_read_only(lua_State *L) { return luaL_argerror(L, 3, "read-only field"); }
+
 // lexer.line_from_position()
 // Note: position argument from Lua is 1-based.
 int line_from_position(lua_State *L) {
-  if (lua_getfield(L, LUA_REGISTRYINDEX, "buffer") != LUA_TLIGHTUSERDATA) // REGISTRY.buffer
-    luaL_error(L, "must be lexing or folding");
-  const auto buffer = static_cast<Scintilla::IDocument *>(lua_touserdata(L, -1));
-  const Sci_PositionU startPos =
-    (lua_getfield(L, LUA_REGISTRYINDEX, "startPos"), lua_tointeger(L, -1)); // REGISTRY.startPos
-  lua_pushinteger(L, buffer->LineFromPosition(startPos + luaL_checkinteger(L, 1) - 1) + 1);
-  return 1;
+  const auto buffer = accessor_buffer(L);
+  const auto context = accessor_context(L);
+  const Sci_PositionU pos = context->startPos + context->lineOffset + luaL_checkinteger(L, 1) - 1;
+  return (lua_pushinteger(L, buffer->LineFromPosition(pos) + 1), 1);
 }
 
-// lexer[key] metamethod.
-int lexer_index(lua_State *L) {
-  const std::string_view key{lua_tostring(L, 2)};
-  if (key == "fold_level" || key == "indent_amount" || key == "property" || key == "property_int" ||
-    key == "style_at" || key == "line_state") {
+// Pushes onto the stack of host *host*'s Lua state a table of the accessors lexer[key] returns,
+// like lexer.style_at and lexer.line_from_position. They are created once per host and read
+// from its context, so using them does not allocate.
+void push_accessors(lua_State *L, LexerHost *host) {
+  struct Accessor {
+    const char *name;
+    lua_CFunction index, newindex;
+  };
+  static constexpr Accessor accessors[] = {{"fold_level", fold_level_index, accessor_read_only},
+    {"indent_amount", indent_amount_index, accessor_read_only},
+    {"line_state", line_state_index, line_state_newindex},
+    {"style_at", style_at_index, accessor_read_only},
+    {"style_number_at", style_number_at_index, accessor_read_only},
+    {"property", property_index, property_newindex},
+    {"property_int", property_index, accessor_read_only}};
+  lua_createtable(L, 0, static_cast<int>(std::size(accessors)) + 1);
+  for (const auto &[name, index, newindex] : accessors) {
     lua_newtable(L);
     lua_createtable(L, 0, 2);
-    lua_pushvalue(L, 2), lua_pushcclosure(L, lexer_field_index, 1), lua_setfield(L, -2, "__index");
-    lua_pushvalue(L, 2), lua_pushcclosure(L, lexer_field_newindex, 1),
-      lua_setfield(L, -2, "__newindex");
-    lua_setmetatable(L, -2); // return setmetatable({}, {__index = f, __newindex = f})
-  } else if (key == "line_from_position")
-    lua_pushcfunction(L, line_from_position);
-  else
-    lua_rawget(L, 1); // lexer[key]
+    lua_pushlightuserdata(L, host);
+    lua_pushboolean(L, strcmp(name, "property_int") == 0);
+    lua_pushcclosure(L, index, 2), lua_setfield(L, -2, "__index");
+    lua_pushlightuserdata(L, host), lua_pushcclosure(L, newindex, 1);
+    lua_setfield(L, -2, "__newindex");
+    lua_setmetatable(L, -2); // setmetatable({}, {__index = f, __newindex = f})
+    lua_setfield(L, -2, name);
+  }
+  lua_pushlightuserdata(L, host), lua_pushcclosure(L, line_from_position, 1);
+  lua_setfield(L, -2, "line_from_position");
+}
+
+// lexer[key] metamethod.
+// The first upvalue is the table of accessors from push_accessors().
+int lexer_index(lua_State *L) {
+  lua_pushvalue(L, 2);
+  if (lua_rawget(L, lua_upvalueindex(1)) == LUA_TNIL) // accessors[key]
+    lua_pop(L, 1), lua_rawget(L, 1); // lexer[key]
   return 1;
 }
 
 // lexer[key] = value metamethod.
 int lexer_newindex(lua_State *L) {
-  const std::string_view key{lua_tostring(L, 2)};
-  luaL_argcheck(L,
-    key != "fold_level" && key != "indent_amount" && key != "property" && key != "property_int" &&
-      key != "style_at" && key != "line_state" && key != "line_from_position",
-    3, "read-only field");
-  return (lua_rawset(L, 1), 0); // lexer[key] = value
+  lua_pushvalue(L, 2);
+  luaL_argcheck(L, lua_rawget(L, lua_upvalueindex(1)) == LUA_TNIL, 3, "read-only field");
+  return (lua_pop(L, 1), lua_rawset(L, 1), 0); // lexer[key] = value
 }
 
-Scintillua::Scintillua(const std::string &lexersDir, const char *name)
-    : DefaultLexer("scintillua", -1), name(name), L{luaL_newstate(), lua_close} {
+Scintillua::Scintillua(const std::string &lexersDir, const char *name, int group)
+    : DefaultLexer("scintillua", -1), name(name), lexersDir(lexersDir), group(group) {
   if (lexersDir.empty()) {
     LogError("scintillua.lexers library property not set");
     return;
   }
   PropertySet("scintillua.lexers", lexersDir.c_str());
-  DeferLuaStackCheck checker{L.get()};
 
-  luaL_requiref(L.get(), "_G", luaopen_base, 1), lua_pop(L.get(), 1);
-  luaL_requiref(L.get(), LUA_TABLIBNAME, luaopen_table, 1), lua_pop(L.get(), 1);
-  luaL_requiref(L.get(), LUA_STRLIBNAME, luaopen_string, 1), lua_pop(L.get(), 1);
-  luaL_requiref(L.get(), "lpeg", luaopen_lpeg, 1), lua_pop(L.get(), 1);
-  luaL_requiref(L.get(), LUA_MATHLIBNAME, luaopen_math, 1), lua_pop(L.get(), 1);
-  luaL_requiref(L.get(), LUA_UTF8LIBNAME, luaopen_utf8, 1), lua_pop(L.get(), 1);
-  lua_pushlightuserdata(L.get(), this),
-    lua_setfield(L.get(), LUA_REGISTRYINDEX, "scintillua"); // REGISTRY.scintillua = this
+  // Share an already loaded lexer if possible.
+  {
+    std::lock_guard<std::mutex> lock{hostsMutex};
+    if (auto it = hosts.find(HostKey()); it != hosts.end()) host = it->second.lock();
+  }
+  if (!host && !LoadHost()) return;
+  L = host->L.get();
+  const auto lock = LockHost();
+  for (const auto &[key, value] : host->lexerProps) PropertySet(key.c_str(), value.c_str());
+  PropertySet(LexerErrorKey, "");
+}
+
+std::string Scintillua::HostKey() const {
+  std::string key{std::to_string(group)};
+  key.append("\n").append(lexersDir).append("\n").append(name);
+  return key;
+}
+
+bool Scintillua::LoadHost() {
+  auto newHost = std::make_shared<LexerHost>();
+  L = newHost->L.get();
+  if (!L) return (LogError("cannot create Lua state"), false);
+  lua_atpanic(L, lua_panic);
+  DeferLuaStackCheck checker{L};
+
+  luaL_requiref(L, "_G", luaopen_base, 1), lua_pop(L, 1);
+  lua_pushcfunction(L, lexer_loadfile), lua_setglobal(L, "loadfile");
+  luaL_requiref(L, LUA_TABLIBNAME, luaopen_table, 1), lua_pop(L, 1);
+  luaL_requiref(L, LUA_STRLIBNAME, luaopen_string, 1), lua_pop(L, 1);
+  luaL_requiref(L, "lpeg", luaopen_lpeg, 1), lua_pop(L, 1);
+  luaL_requiref(L, LUA_MATHLIBNAME, luaopen_math, 1), lua_pop(L, 1);
+  luaL_requiref(L, LUA_UTF8LIBNAME, luaopen_utf8, 1), lua_pop(L, 1);
+  // Properties set by the lexer while loading are recorded in the new host.
+  host = newHost;
+  ContextField ctxLexer{host->context.lexer, this};
 
   // Load the lexer module.
   size_t start, end = 0;
@@ -251,65 +1265,78 @@ Scintillua::Scintillua(const std::string &lexersDir, const char *name)
     end = lexersDir.find(';', start);
     std::string dir{lexersDir, start, end - start};
     dir.append("/lexer.lua");
-    switch (luaL_loadfile(L.get(), dir.c_str())) { // loadfile('path/to/lexer.lua')
+    switch (LoadSource(L, dir.c_str(), nullptr)) { // loadfile('path/to/lexer.lua')
     case LUA_ERRFILE:
-      lua_pop(L.get(), 1); // error message
+      lua_pop(L, 1); // error message
       continue; // try next directory
     case LUA_OK:
-      lua_pushcfunction(L.get(), lua_error_handler), lua_insert(L.get(), -2);
-      if (lua_pcall(L.get(), 0, 1, -2) != LUA_OK) { // lexer = xpcall(loadfile('lexer.lua'), msgh)
-        LogError();
-        return;
-      }
-      lua_remove(L.get(), -2); // lua_error_handler
+      lua_pushcfunction(L, lua_error_handler), lua_insert(L, -2);
+      if (protected_call(L, 0, 1, -2) != LUA_OK) // lexer = xpcall(loadfile('lexer.lua'), msgh)
+        return (LogError(), false);
+      lua_remove(L, -2); // lua_error_handler
       break;
-    default: LogError(); return;
+    default: return (LogError(), false);
     }
   }
-  if (!lua_gettop(L.get())) {
-    LogError("could not find lexer.lua");
-    return;
-  }
-  if (!lua_istable(L.get(), -1)) {
-    LogError("expected module return from lexer.lua");
-    return;
-  }
-
-  lua_pushinteger(L.get(), SC_FOLDLEVELBASE), lua_setfield(L.get(), -2, "FOLD_BASE");
-  lua_pushinteger(L.get(), SC_FOLDLEVELWHITEFLAG), lua_setfield(L.get(), -2, "FOLD_BLANK");
-  lua_pushinteger(L.get(), SC_FOLDLEVELHEADERFLAG), lua_setfield(L.get(), -2, "FOLD_HEADER");
-  lua_createtable(L.get(), 0, 2);
-  lua_pushcfunction(L.get(), lexer_index), lua_setfield(L.get(), -2, "__index");
-  lua_pushcfunction(L.get(), lexer_newindex), lua_setfield(L.get(), -2, "__newindex");
-  lua_setmetatable(L.get(), -2); // setmetatable(lexer, {__index = f, __newindex = f})
-
-  lua_getfield(L.get(), LUA_REGISTRYINDEX, "_LOADED");
-  lua_pushvalue(L.get(), -2), lua_setfield(L.get(), -2, "lexer"); // _LOADED['lexer'] = lexer
-  lua_pop(L.get(), 1); // _LOADED
+  if (!lua_gettop(L)) return (LogError("could not find lexer.lua"), false);
+  if (!lua_istable(L, -1)) return (LogError("expected module return from lexer.lua"), false);
+
+  lua_pushinteger(L, SC_FOLDLEVELBASE), lua_setfield(L, -2, "FOLD_BASE");
+  lua_pushinteger(L, SC_FOLDLEVELWHITEFLAG), lua_setfield(L, -2, "FOLD_BLANK");
+  lua_pushinteger(L, SC_FOLDLEVELHEADERFLAG), lua_setfield(L, -2, "FOLD_HEADER");
+  lua_pushlightuserdata(L, host.get()), lua_pushcclosure(L, lexer_emit, 1);
+  lua_setfield(L, -2, "_emit");
+  lua_pushlightuserdata(L, host.get()), lua_pushcclosure(L, lexer_tag_id, 1);
+  lua_setfield(L, -2, "_tag_id");
+  lua_pushcfunction(L, lexer_clock), lua_setfield(L, -2, "_clock");
+  lua_pushcfunction(L, lexer_word_matcher), lua_setfield(L, -2, "_word_matcher");
+  lua_pushcfunction(L, lexer_set_words), lua_setfield(L, -2, "_set_words");
+  luaL_newmetatable(L, WordSetMetatable);
+  lua_pushcfunction(L, word_set_gc), lua_setfield(L, -2, "__gc");
+  lua_pop(L, 1); // metatable
+  luaL_newmetatable(L, BufferViewMetatable);
+  lua_pushcfunction(L, buffer_view_index), lua_setfield(L, -2, "__index");
+  lua_pushcfunction(L, buffer_view_len), lua_setfield(L, -2, "__len");
+  lua_pushcfunction(L, buffer_view_concat), lua_setfield(L, -2, "__concat");
+  lua_pushcfunction(L, buffer_view_tostring), lua_setfield(L, -2, "__tostring");
+  lua_pop(L, 1); // metatable
+  lua_createtable(L, 0, 2);
+  push_accessors(L, host.get());
+  lua_pushvalue(L, -1), lua_pushcclosure(L, lexer_index, 1), lua_setfield(L, -3, "__index");
+  lua_pushcclosure(L, lexer_newindex, 1), lua_setfield(L, -2, "__newindex");
+  lua_setmetatable(L, -2); // setmetatable(lexer, {__index = f, __newindex = f})
+
+  lua_getfield(L, LUA_REGISTRYINDEX, "_LOADED");
+  lua_pushvalue(L, -2), lua_setfield(L, -2, "lexer"); // _LOADED['lexer'] = lexer
+  lua_pop(L, 1); // _LOADED
 
   // Call lexer.load(name).
-  if (lua_getfield(L.get(), -1, "load") != LUA_TFUNCTION) {
-    LogError("cannot find lexer.load()");
-    return;
-  }
-  lua_pushcfunction(L.get(), lua_error_handler), lua_insert(L.get(), -2);
-  lua_pushstring(L.get(), name);
-  if (lua_pcall(L.get(), 1, 1, -3) != LUA_OK) { // lex = xpcall(lexer.load, msgh, name)
-    const bool print = !strstr(lua_tostring(L.get(), -1), "no file");
-    LogError(nullptr, print);
-    return;
+  if (lua_getfield(L, -1, "load") != LUA_TFUNCTION)
+    return (LogError("cannot find lexer.load()"), false);
+  lua_pushcfunction(L, lua_error_handler), lua_insert(L, -2);
+  lua_pushstring(L, name.c_str());
+  if (protected_call(L, 1, 1, -3) != LUA_OK) { // lex = xpcall(lexer.load, msgh, name)
+    const bool print = !strstr(lua_tostring(L, -1), "no file");
+    return (LogError(nullptr, print), false);
   }
-  lua_remove(L.get(), -2); // lua_error_handler
-  lua_pushvalue(L.get(), -1), lua_setfield(L.get(), LUA_REGISTRYINDEX, "lex"); // REGISTRY.lex = lex
+  lua_remove(L, -2); // lua_error_handler
+  lua_pushvalue(L, -1), lua_setfield(L, LUA_REGISTRYINDEX, "lex"); // REGISTRY.lex = lex
+  LoadStyles();
 
-  if (lua_getfield(L.get(), -1, "_CHILDREN") == LUA_TTABLE) { // lex._CHILDREN
-    multilang = true;
-    for (int i = 0; i < STYLE_MAX; i++) ws[i] = strstr(NameOfStyle(i), "whitespace") != nullptr;
-  }
-  lua_pop(L.get(), 1); // lex._CHILDREN
+  if (lua_getfield(L, -1, "_CHILDREN") == LUA_TTABLE) host->multilang = true; // lex._CHILDREN
+  lua_pop(L, 1); // lex._CHILDREN
+  lua_getfield(L, -1, "_complete_line_state"), lua_getfield(L, -2, "_lex_by_line");
+  host->completeLineState = lua_toboolean(L, -2) || lua_toboolean(L, -1);
+  lua_pop(L, 2); // lex._lex_by_line, lex._complete_line_state
 
-  lua_pop(L.get(), 2); // lex, lexer
-  PropertySet(LexerErrorKey, "");
+  lua_pop(L, 2); // lex, lexer
+
+  if (!ApplyWordLists()) return false;
+
+  host->key = HostKey();
+  std::lock_guard<std::mutex> lock{hostsMutex};
+  hosts[host->key] = host;
+  return true;
 }
 
 void Scintillua::Release() { delete this; }
@@ -323,198 +1350,893 @@ const char *Scintillua::DescribeProperty(const char *name_) {
 Sci_Position Scintillua::PropertySet(const char *key, const char *value) {
   const bool reLex = properties.PropertySet(&placeholder, key, value);
   props.Set(key, value);
+  if (host && strcmp(key, ProfileKey) == 0) return (SetProfiling(props.GetInt(key) > 0), 0);
+  if (strcmp(key, MemoryLimitKey) == 0)
+    memoryLimit = static_cast<size_t>(std::max(props.GetInt(key), 0));
+  if (host && strcmp(key, DispatchKey) == 0) {
+    const auto lock = LockHost();
+    return (SetGrammarOption("_dispatch", props.GetInt(key) > 0), 0);
+  }
   return reLex ? 0 : -1;
 }
 
+void Scintillua::SetGrammarOption(const char *field, bool enable) {
+  DeferLuaStackCheck checker{L};
+  lua_getfield(L, LUA_REGISTRYINDEX, "_LOADED"), lua_getfield(L, -1, "lexer");
+  enable ? lua_newtable(L) : lua_pushnil(L);
+  lua_setfield(L, -2, field); // lexer[field] = enable and {} or nil
+  lua_pop(L, 2); // lexer, _LOADED
+  lua_getfield(L, LUA_REGISTRYINDEX, "lex"); // lex = REGISTRY.lex
+  lua_pushnil(L), lua_setfield(L, -2, "_grammar_table"); // lex._grammar_table = nil
+  lua_pop(L, 1); // lex
+}
+
+void Scintillua::SetProfiling(bool enable) {
+  const auto lock = LockHost();
+  host->profiling = enable, host->lexTiming = host->foldTiming = {};
+  SetGrammarOption("_profile", enable); // rules are instrumented when compiling a grammar
+}
+
+std::string Scintillua::ProfileStats() {
+  const auto lock = LockHost();
+  if (!host->profiling) return "";
+  DeferLuaStackCheck checker{L};
+  std::string stats;
+  char line[256];
+  for (const auto &[name, timing] :
+    {std::make_pair("Lex()", host->lexTiming), std::make_pair("Fold()", host->foldTiming)}) {
+    snprintf(line, sizeof(line), "%s\t%zu calls\t%zu bytes\t%zu processed\t%.6f s\n", name,
+      timing.calls, timing.bytes, timing.processed, timing.seconds);
+    stats.append(line);
+  }
+
+  // Read lexer._profile's {attempts, matches, bytes, seconds} for each rule.
+  struct RuleStats {
+    std::string id;
+    lua_Integer counts[3] = {}; // attempts, matches, bytes
+    double seconds = 0;
+  };
+  std::vector<RuleStats> rules;
+  lua_getfield(L, LUA_REGISTRYINDEX, "_LOADED"), lua_getfield(L, -1, "lexer");
+  if (lua_getfield(L, -1, "_profile") == LUA_TTABLE) // lexer._profile
+    for (lua_pushnil(L); lua_next(L, -2); lua_pop(L, 1)) {
+      if (lua_type(L, -2) != LUA_TSTRING || !lua_istable(L, -1)) continue;
+      RuleStats &rule = rules.emplace_back(RuleStats{lua_tostring(L, -2)});
+      for (int i = 0; i < 3; i++)
+        lua_rawgeti(L, -1, i + 1), rule.counts[i] = lua_tointeger(L, -1), lua_pop(L, 1);
+      lua_rawgeti(L, -1, 4), rule.seconds = lua_tonumber(L, -1), lua_pop(L, 1);
+    }
+  lua_pop(L, 3); // lexer._profile, lexer, _LOADED
+  std::sort(rules.begin(), rules.end(),
+    [](const RuleStats &a, const RuleStats &b) { return a.seconds > b.seconds; });
+
+  stats.append("rule\tattempts\tmatches\tbytes\tseconds\n");
+  for (const auto &rule : rules) {
+    snprintf(line, sizeof(line), "\t%lld\t%lld\t%lld\t%.6f\n",
+      static_cast<long long>(rule.counts[0]), static_cast<long long>(rule.counts[1]),
+      static_cast<long long>(rule.counts[2]), rule.seconds);
+    stats.append(rule.id).append(line);
+  }
+  return stats;
+}
+
 const char *SCI_METHOD Scintillua::DescribeWordListSets() {
-  DeferLuaStackCheck checker{L.get()};
+  const auto lock = LockHost();
+  DeferLuaStackCheck checker{L};
   wordListsDescription = "";
-  lua_getfield(L.get(), LUA_REGISTRYINDEX, "lex"); // lex = REGISTRY.lex
-  if (lua_getfield(L.get(), -1, "_WORDLISTS") == LUA_TTABLE) { // lex._WORDLISTS
-    std::vector<std::string> names(lua_rawlen(L.get(), -1));
-    for (lua_pushnil(L.get()); lua_next(L.get(), -2); lua_pop(L.get(), 1))
-      if (lua_type(L.get(), -2) == LUA_TSTRING && lua_isnumber(L.get(), -1)) // {name = i}
-        names[lua_tointeger(L.get(), -1) - 1] = lua_tostring(L.get(), -2); // indices are 1-based
+  lua_getfield(L, LUA_REGISTRYINDEX, "lex"); // lex = REGISTRY.lex
+  if (lua_getfield(L, -1, "_WORDLISTS") == LUA_TTABLE) { // lex._WORDLISTS
+    std::vector<std::string> names(lua_rawlen(L, -1));
+    for (lua_pushnil(L); lua_next(L, -2); lua_pop(L, 1))
+      if (lua_type(L, -2) == LUA_TSTRING && lua_isnumber(L, -1)) // {name = i}
+        names[lua_tointeger(L, -1) - 1] = lua_tostring(L, -2); // indices are 1-based
     for (size_t i = 0; i < names.size(); i++)
       wordListsDescription.append(names[i]), wordListsDescription.append("\n");
   }
-  lua_pop(L.get(), 2); // lex._WORDLISTS, lex
+  lua_pop(L, 2); // lex._WORDLISTS, lex
   return wordListsDescription.c_str();
 }
 
-Sci_Position SCI_METHOD Scintillua::WordListSet(int n, const char *wl) {
-  DeferLuaStackCheck checker{L.get()};
-  lua_getfield(L.get(), LUA_REGISTRYINDEX, "lex"); // lex = REGISTRY.lex
-  if (lua_getfield(L.get(), -1, "set_word_list") != LUA_TFUNCTION) // lex.set_word_list
-    return (LogError("cannot find lexer.set_word_list()"), 0);
-  lua_pushcfunction(L.get(), lua_error_handler), lua_insert(L.get(), -2);
-  lua_pushvalue(L.get(), -3);
-  lua_pushinteger(L.get(), n + 1); // convert to 1-based
-  lua_pushstring(L.get(), wl);
-  if (lua_pcall(L.get(), 3, 0, -5) != LUA_OK) // xpcall(lex.set_word_list, msgh, lex, n, wl)
-    return (LogError(), 0);
-  lua_pop(L.get(), 2); // lua_error_handler, lex
-  return 1; // re-lex
+bool Scintillua::SetWordList(int n, const char *wl) {
+  DeferLuaStackCheck checker{L};
+  lua_getfield(L, LUA_REGISTRYINDEX, "lex"); // lex = REGISTRY.lex
+  if (lua_getfield(L, -1, "set_word_list") != LUA_TFUNCTION) // lex.set_word_list
+    return (LogError("cannot find lexer.set_word_list()"), false);
+  lua_pushcfunction(L, lua_error_handler), lua_insert(L, -2);
+  lua_pushvalue(L, -3);
+  lua_pushinteger(L, n + 1); // convert to 1-based
+  lua_pushstring(L, wl);
+  if (protected_call(L, 3, 0, -5) != LUA_OK) // xpcall(lex.set_word_list, msgh, lex, n, wl)
+    return (LogError(), false);
+  lua_pop(L, 2); // lua_error_handler, lex
+  return true;
 }
 
-// RAII for Lua registry fields.
-class LuaRegistryField {
-  lua_State *L;
-  const char *key;
+Sci_Position SCI_METHOD Scintillua::WordListSet(int n, const char *wl) {
+  if (!host || n < 0) return 0;
+  if (strcmp(wl, "scintillua") == 0) return -1; // SciTE's placeholder; set_word_list() ignores it
+  if (static_cast<size_t>(n) >= wordLists.size()) wordLists.resize(n + 1);
+  if (wordLists[n] == wl) return -1; // no change
+  wordLists[n] = wl; // even "", which clears the lexer's own list
+  wordListsVersion = ++lastWordListsVersion;
+  const auto lock = LockHost();
+  return ApplyWordLists() ? 1 : 0; // re-lex
+}
 
-public:
-  LuaRegistryField(lua_State *L, const char *key, void *value) : L(L), key{key} {
-    lua_pushlightuserdata(L, value), lua_setfield(L, LUA_REGISTRYINDEX, key);
+bool Scintillua::ApplyWordLists() {
+  if (host->wordListsVersion == wordListsVersion) return true;
+  DeferLuaStackCheck checker{L};
+  ContextField ctxLexer{host->context.lexer, this};
+  auto &applied = host->wordLists;
+  static const std::optional<std::string> none;
+  for (size_t i = 0; i < std::max(applied.size(), wordLists.size()); i++) {
+    const std::optional<std::string> &list = i < wordLists.size() ? wordLists[i] : none;
+    if (list == (i < applied.size() ? applied[i] : none)) continue;
+    // Remember the lexer's own word list before replacing it, and restore it for instances
+    // that do not set one.
+    if (!host->ownWordLists.count(i)) {
+      lua_pushcfunction(L, lua_error_handler);
+      lua_getfield(L, LUA_REGISTRYINDEX, "_LOADED"), lua_getfield(L, -1, "lexer");
+      lua_getfield(L, -1, "_word_list_string"), lua_replace(L, -3), lua_pop(L, 1);
+      lua_getfield(L, LUA_REGISTRYINDEX, "lex"), lua_pushinteger(L, i + 1); // 1-based
+      if (protected_call(L, 2, 1, -4) != LUA_OK) // xpcall(_word_list_string, msgh, lex, i)
+        return (LogError(), false);
+      host->ownWordLists[i] = lua_isstring(L, -1) ? lua_tostring(L, -1) : "";
+      lua_pop(L, 2); // list, lua_error_handler
+    }
+    if (!SetWordList(i, list ? list->c_str() : host->ownWordLists[i].c_str())) {
+      host->wordListsVersion = ++lastWordListsVersion; // matches no instance
+      return false;
+    }
+    if (i >= applied.size()) applied.resize(i + 1);
+    applied[i] = list;
   }
-  LuaRegistryField(lua_State *L, const char *key, Sci_PositionU value) : L(L), key{key} {
-    lua_pushinteger(L, value), lua_setfield(L, LUA_REGISTRYINDEX, key);
+  host->wordListsVersion = wordListsVersion;
+  return true;
+}
+
+// Returns the FNV-1a hash of the given line's text. Hashes are never 0.
+uint32_t LineHash(Scintilla::IDocument *buffer, Sci_Position line) {
+  const char *text = buffer->BufferPointer();
+  uint32_t hash = 2166136261u;
+  for (Sci_Position i = buffer->LineStart(line); i < buffer->LineStart(line + 1); i++)
+    hash = (hash ^ static_cast<unsigned char>(text[i])) * 16777619u;
+  return hash ? hash : 1;
+}
+
+Scintillua::Checkpoint Scintillua::CheckpointAt(Lexilla::LexAccessor &styler, Sci_PositionU pos) {
+  Checkpoint checkpoint{static_cast<unsigned char>(styler.StyleAt(pos - 1)), 0,
+    styler.GetLineState(styler.GetLine(pos) - 1)};
+  // Only multilang lexers with complete line states can stop early at a line start that is not
+  // resumable, so only they need to look back for the current language.
+  if (host->ws[checkpoint.style])
+    checkpoint.wsStyle = checkpoint.style;
+  else if (host->multilang && host->completeLineState) {
+    Sci_PositionU i = pos - 1;
+    while (i > 0 && !host->ws[static_cast<unsigned char>(styler.StyleAt(i))]) i--;
+    checkpoint.wsStyle = static_cast<unsigned char>(styler.StyleAt(i));
   }
-  ~LuaRegistryField() { lua_pushnil(L), lua_setfield(L, LUA_REGISTRYINDEX, key); }
-};
+  return checkpoint;
+}
+
+bool Scintillua::LineUnchanged(Lexilla::LexAccessor &styler, Scintilla::IDocument *buffer,
+  Sci_PositionU pos, Sci_PositionU end) {
+  const Sci_Position line = styler.GetLine(pos);
+  if (styler.LineStart(line) != static_cast<Sci_Position>(pos) ||
+    styler.LineStart(line + 1) != static_cast<Sci_Position>(end) ||
+    line >= static_cast<Sci_Position>(lineHashes.size()) || lineHashes[line] == 0 ||
+    lineHashes[line] != LineHash(buffer, line))
+    return false;
+  // Note: inserted text has style 0, which Lua lexers do not use.
+  for (Sci_PositionU i = pos; i < end; i++)
+    if (styler.StyleAt(i) == 0) return false;
+  return true;
+}
+
+Sci_Position Scintillua::ResumeAt(Lexilla::LexAccessor &styler, Sci_Position line, int &style) {
+  for (; line > 0; line--)
+    if (style = static_cast<unsigned char>(styler.StyleAt(styler.LineStart(line) - 1));
+        host->ws[style])
+      return line;
+  return (style = STYLE_DEFAULT, 0); // lex from the start in the lexer's own language
+}
 
 void Scintillua::Lex(
-  Sci_PositionU startPos, Sci_Position lengthDoc, int initStyle, Scintilla::IDocument *buffer) {
+  Sci_PositionU startPos, Sci_Position lengthDoc, int, Scintilla::IDocument *buffer) {
   Lexilla::LexAccessor styler(buffer);
-  DeferLuaStackCheck checker{L.get()};
-  LuaRegistryField regBuf{L.get(), "buffer", buffer}; // REGISTRY.buffer = buffer
-  lua_getfield(L.get(), LUA_REGISTRYINDEX, "lex"); // lex = REGISTRY.lex
-
-  // Start from the beginning of the current style so the lexer can match the tag.
-  // For multilang lexers, start at whitespace since embedded languages have whitespace.[lang]
-  // styles. This is so the lexer can start matching child languages instead of parent ones
-  // if necessary.
-  if (startPos > 0) {
-    Sci_PositionU i = startPos;
-    while (i > 0 && styler.StyleAt(i - 1) == initStyle) i--;
-    if (multilang)
-      while (i > 0 && !ws[static_cast<size_t>(styler.StyleAt(i))]) i--;
-    lengthDoc += startPos - i, startPos = i;
+  const auto lock = LockHost();
+  ProfileTimer timer{host->profiling ? &host->lexTiming : nullptr, lengthDoc};
+  DeferLuaStackCheck checker{L};
+  ContextField ctxLexer{host->context.lexer, this};
+  ContextField ctxBuffer{host->context.buffer, buffer};
+  // Instances that share this host may have different word lists. Note: if they cannot be
+  // applied, lex with whatever word lists the host has.
+  ApplyWordLists();
+
+  // Lexing from the start of the document (e.g. after a property or word list change) restyles
+  // everything, so previously lexed lines cannot be reused.
+  if (startPos == 0) lineHashes.clear();
+  const int budget = props.GetInt("lexer.scintillua.budget.ms");
+  lexDeadline = budget > 0 ?
+    std::chrono::steady_clock::now() + std::chrono::milliseconds{budget} :
+    std::chrono::steady_clock::time_point::max();
+  lexStop = 0, unchangedPos = 0;
+  const Sci_PositionU endPos = startPos + lengthDoc;
+  const Sci_Position lineCount = styler.GetLine(styler.Length()) + 1;
+  const Sci_Position oldLineCount = lineHashes.size();
+  const Sci_Position lineDelta = lineCount - oldLineCount;
+  const Sci_Position startLine = styler.GetLine(startPos), lastLine = styler.GetLine(endPos - 1);
+
+  // Find the first line whose text, and the text of all lines after it up to endPos, has not
+  // changed since the last lex. Lines after the last edit have shifted by the number of lines
+  // added or deleted, and lines from the first edit (at startLine) up to there form the edited
+  // range. Splice the hashes of the lines in that range out, since there may have been several
+  // edits in between and nothing is known about them.
+  Sci_Position unchangedLine = lastLine + 1;
+  while (unchangedLine > startLine + 1) {
+    const Sci_Position old = unchangedLine - 1 - lineDelta; // line number before the edits
+    if (old <= startLine || old >= oldLineCount || lineHashes[old] == 0 ||
+      lineHashes[old] != LineHash(buffer, unchangedLine - 1))
+      break;
+    unchangedLine--;
+  }
+  const Sci_Position keptLine = std::min(startLine, oldLineCount);
+  const Sci_Position shiftedLine = std::clamp(unchangedLine - lineDelta, keptLine, oldLineCount);
+  lineHashes.erase(lineHashes.begin() + keptLine, lineHashes.begin() + shiftedLine);
+  lineHashes.insert(lineHashes.begin() + keptLine, unchangedLine - keptLine, 0);
+  lineHashes.resize(lineCount, 0);
+
+  // Resume lexing from the nearest line start before the edit whose line ends in whitespace.
+  // Then lex up to checkpoints at line starts, starting with the first unchanged line after the
+  // edited range. If the lexer's state at a checkpoint is resumable and the same as it was
+  // before, the rest of the text would lex the same way it did then, so stop early and keep its
+  // existing styles. Lexers whose line state is complete can stop at any checkpoint whose state
+  // is the same. Otherwise, resume lexing from the checkpoint (or the nearest resumable line
+  // start before it) up to the next one, spacing them further apart each time.
+  int style = STYLE_DEFAULT;
+  const Sci_Position firstLexLine = startPos > 0 ? ResumeAt(styler, startLine, style) : 0;
+  Sci_PositionU pos = styler.LineStart(firstLexLine), lexEnd = endPos;
+  Sci_Position checkpointLine = unchangedLine, checkpointSpacing = 16;
+  while (true) {
+    if (checkpointLine > lastLine) {
+      if (!LexWindows(styler, pos, endPos - pos, style, buffer)) return lineHashes.clear();
+      if (lexStop) lexEnd = lexStop;
+      break;
+    }
+    const Sci_PositionU checkpointPos = styler.LineStart(checkpointLine);
+    const Checkpoint prev = CheckpointAt(styler, checkpointPos);
+    if (!LexWindows(styler, pos, checkpointPos - pos, style, buffer)) return lineHashes.clear();
+    if (lexStop) {
+      lexEnd = lexStop;
+      break;
+    }
+    // Note: inserted text has style 0, which Lua lexers do not use, so never keep it.
+    bool unchanged = prev.style != 0 && CheckpointAt(styler, checkpointPos) == prev &&
+      (host->ws[prev.style] || host->completeLineState);
+    for (Sci_PositionU i = checkpointPos; unchanged && i < endPos; i++)
+      if (styler.StyleAt(i) == 0) unchanged = false;
+    if (unchanged || OverBudget()) {
+      lexEnd = checkpointPos;
+      if (!unchanged) lexStop = checkpointPos;
+      break;
+    }
+    // If there is no resumable line start after pos, lex from pos again.
+    int resumeStyle;
+    const Sci_PositionU resumePos = styler.LineStart(ResumeAt(styler, checkpointLine, resumeStyle));
+    if (resumePos > pos) pos = resumePos, style = resumeStyle;
+    checkpointLine += checkpointSpacing, checkpointSpacing *= 2;
   }
+
+  // Keep existing styles after the last checkpoint. If lexing stopped early instead, leave the
+  // rest of the range unstyled so the application styles it in a later call, starting from
+  // lexEnd.
+  if (lexEnd < endPos && !lexStop) {
+    styler.StartAt(lexEnd);
+    styler.StartSegment(lexEnd);
+    for (Sci_PositionU i = lexEnd; i < endPos; i++)
+      if (i + 1 == endPos || styler.StyleAt(i + 1) != styler.StyleAt(i))
+        styler.ColourTo(i, static_cast<unsigned char>(styler.StyleAt(i)));
+    styler.Flush();
+  }
+
+  if (lexEnd < endPos && !lexStop) unchangedPos = lexEnd;
+
+  // Record the hashes of the lexed lines for the next lex. Lines left unstyled after an early
+  // stop must be lexed again.
+  const Sci_Position lastLexLine = styler.GetLine(lexEnd - 1);
+  for (Sci_Position line = firstLexLine; line <= lastLexLine; line++)
+    lineHashes[line] = LineHash(buffer, line);
+  if (lexStop)
+    std::fill(lineHashes.begin() + lastLexLine + 1, lineHashes.begin() + lastLine + 1, 0);
+}
+
+bool Scintillua::LexWindows(Lexilla::LexAccessor &styler, Sci_PositionU startPos,
+  Sci_Position lengthDoc, int initStyle, Scintilla::IDocument *buffer) {
+  Sci_Position window = props.GetInt("lexer.scintillua.window", 1 << 20);
+  // Use small enough windows that a budget is checked often enough to be kept.
+  constexpr Sci_Position budgetWindow = 1 << 16;
+  if (lexDeadline != std::chrono::steady_clock::time_point::max() &&
+    (window <= 0 || window > budgetWindow))
+    window = budgetWindow;
+  const Sci_PositionU endPos = startPos + lengthDoc;
+  Sci_PositionU pos = startPos;
+  for (Sci_Position size = window; window > 0 && static_cast<Sci_Position>(endPos - pos) > size;) {
+    // End each window at a line start, and resume lexing from the nearest resumable line start
+    // before it the same way Lex() would after an edit. If there is none in the window, no
+    // progress can be made, so widen the window and try again.
+    const Sci_Position windowEndLine = styler.GetLine(pos + size);
+    if (const Sci_PositionU windowEnd = styler.LineStart(windowEndLine); windowEnd > pos) {
+      if (!LexRange(styler, pos, windowEnd - pos, initStyle, buffer)) return false;
+      if (OverBudget()) return (lexStop = windowEnd, true);
+      int style;
+      if (const Sci_PositionU next = styler.LineStart(ResumeAt(styler, windowEndLine, style));
+          next > pos) {
+        pos = next, initStyle = style, size = window;
+        continue;
+      }
+    }
+    size *= 2;
+  }
+  return LexRange(styler, pos, endPos - pos, initStyle, buffer);
+}
+
+bool Scintillua::LexRange(Lexilla::LexAccessor &styler, Sci_PositionU startPos,
+  Sci_Position lengthDoc, int initStyle, Scintilla::IDocument *buffer) {
+  if (lengthDoc <= 0) return true;
+  lua_getfield(L, LUA_REGISTRYINDEX, "lex"); // lex = REGISTRY.lex
   styler.StartAt(startPos);
   styler.StartSegment(startPos);
-  LuaRegistryField regStartPos{L.get(), "startPos", startPos}; // REGISTRY.startPos = startPos
+  ContextField ctxStartPos{host->context.startPos, startPos};
 
   // Call lexer.lex(lex, text, init_style).
-  if (lua_getfield(L.get(), -1, "lex") != LUA_TFUNCTION) {
+  if (lua_getfield(L, -1, "lex") != LUA_TFUNCTION) {
     styler.ColourTo(startPos + lengthDoc - 1, initStyle), styler.Flush();
-    return LogError("cannot find lexer.lex()");
+    return (LogError("cannot find lexer.lex()"), false);
   }
-  lua_pushcfunction(L.get(), lua_error_handler), lua_insert(L.get(), -2);
-  lua_pushvalue(L.get(), -3);
-  lua_pushlstring(L.get(), buffer->BufferPointer() + startPos, lengthDoc);
-  lua_pushinteger(L.get(), styler.StyleAt(startPos) + 1);
-  if (lua_pcall(L.get(), 3, 1, -5) != LUA_OK) { // t = xpcall(lexer.lex, msgh, lex, text, initStyle)
-    styler.ColourTo(startPos + lengthDoc - 1, initStyle), styler.Flush();
-    return LogError();
+  auto &runs = host->runs;
+  runs.clear();
+  if (!host->nameStyles.empty()) {
+    host->nameStyles.clear();
+    lua_pushnil(L), lua_setfield(L, LUA_REGISTRYINDEX, "emitted_tags"); // unpin cached names
   }
-  lua_remove(L.get(), -2); // lua_error_handler
-  if (!lua_istable(L.get(), -1)) {
-    styler.ColourTo(startPos + lengthDoc - 1, initStyle), styler.Flush();
-    return LogError("table of tags expected from lexer.lex()");
+  // Lexers may create tags while building their grammars, so read any new style names.
+  lua_getfield(L, -2, "_TAGS"); // lex._TAGS
+  if (static_cast<int>(lua_rawlen(L, -1)) != host->numStyles) LoadStyles();
+  lua_pop(L, 1); // lex._TAGS
+
+  // Lex line by line natively unless the lexer has its own lex() function.
+  lua_getfield(L, LUA_REGISTRYINDEX, "_LOADED"), lua_getfield(L, -1, "lexer");
+  lua_getfield(L, -1, "lex"); // _LOADED['lexer'].lex
+  const bool defaultLex = lua_rawequal(L, -1, -4);
+  lua_pop(L, 3); // _LOADED['lexer'].lex, _LOADED['lexer'], _LOADED
+  lua_getfield(L, -2, "_lex_by_line"); // lex._lex_by_line
+  const bool byLine = defaultLex && lua_toboolean(L, -1);
+  lua_pop(L, 1); // lex._lex_by_line
+  if (byLine) {
+    lua_pop(L, 1); // lex.lex
+    if (!LexLines(styler, startPos, lengthDoc, initStyle, buffer)) {
+      styler.ColourTo(startPos + lengthDoc - 1, initStyle), styler.Flush();
+      return (LogError(), false);
+    }
+  } else {
+    if (host->profiling) host->lexTiming.processed += lengthDoc;
+    lua_pushcfunction(L, lua_error_handler), lua_insert(L, -2);
+    lua_pushvalue(L, -3);
+    // LPeg can only match Lua strings, so unlike folding, lexing cannot pass a BufferView and
+    // copies its range. LexWindows() bounds that copy by its window size instead.
+    lua_pushlstring(L, buffer->BufferPointer() + startPos, lengthDoc);
+    lua_pushinteger(L, initStyle + 1);
+    if (protected_call(L, 3, 1, -5) != LUA_OK) { // t = xpcall(lexer.lex, msgh, lex, text, style)
+      styler.ColourTo(startPos + lengthDoc - 1, initStyle), styler.Flush();
+      return (LogError(), false);
+    }
+    lua_remove(L, -2); // lua_error_handler
+    if (!lua_istable(L, -1)) {
+      styler.ColourTo(startPos + lengthDoc - 1, initStyle), styler.Flush();
+      return (LogError("table of tags expected from lexer.lex()"), false);
+    }
+
+    // Lexers normally emit style runs directly. Otherwise (e.g. lexers with their own lex()
+    // function), convert the returned table of tags to style runs.
+    const int len = lua_rawlen(L, -1);
+    if (runs.empty() && len > 0) {
+      lua_getfield(L, -2, "_TAGS"); // lex._TAGS
+      for (int i = 1; i < len; i += 2) { // for i = 1, #t, 2 do ... end
+        int style = STYLE_DEFAULT;
+        lua_rawgeti(L, -2, i); // tag = t[i]
+        if (lua_rawget(L, -2)) // lex._TAGS[tag]
+          style = lua_tointeger(L, -1) - 1; // returned styles are 1-based
+        lua_pop(L, 1); // lex._TAGS[tag]
+        lua_rawgeti(L, -2, i + 1); // pos = t[i + 1]
+        runs.push_back({style, static_cast<Sci_PositionU>(lua_tointeger(L, -1))});
+        lua_pop(L, 1); // pos
+      }
+      lua_pop(L, 1); // lex._TAGS
+    }
+    lua_pop(L, 1); // tag table
   }
 
-  // Style the text from the returned table of tags.
-  const int len = lua_rawlen(L.get(), -1);
-  if (len > 0) {
+  // Style the text from the style runs.
+  if (!runs.empty()) {
     int style = STYLE_DEFAULT;
-    lua_getfield(L.get(), -2, "_TAGS"); // lex._TAGS
-    for (int i = 1; i < len; i += 2) { // for i = 1, #t, 2 do ... end
-      style = STYLE_DEFAULT;
-      lua_rawgeti(L.get(), -2, i); // tag = t[i]
-      if (lua_rawget(L.get(), -2)) // lex._TAGS[tag]
-        style = lua_tointeger(L.get(), -1) - 1; // returned styles are 1-based
-      lua_pop(L.get(), 1); // lex._TAGS[tag]
-      lua_rawgeti(L.get(), -2, i + 1); // pos = t[i + 1]
-      const Sci_PositionU position = lua_tointeger(L.get(), -1) - 1; // returned pos is 1-based
-      lua_pop(L.get(), 1); // pos
+    for (const auto &run : runs) {
+      style = run.style;
+      const Sci_PositionU position = run.end - 1; // run end is 1-based
       if (style < 0 || style >= STYLE_MAX) {
         styler.ColourTo(startPos + lengthDoc - 1, initStyle), styler.Flush();
-        lua_pushfstring(L.get(), "invalid style number: %d", style);
-        return LogError();
+        lua_pushfstring(L, "invalid style number: %d", style);
+        return (LogError(), false);
       }
       styler.ColourTo(startPos + position - 1, style);
       if (position > startPos + lengthDoc) break;
     }
-    lua_pop(L.get(), 1); // lex._TAGS
     styler.ColourTo(startPos + lengthDoc - 1, style);
     styler.Flush();
   }
-  lua_pop(L.get(), 1); // tag table
 
-  lua_pop(L.get(), 1); // lex
+  lua_pop(L, 1); // lex
+  return true;
+}
+
+bool Scintillua::LexLines(Lexilla::LexAccessor &styler, Sci_PositionU startPos,
+  Sci_Position lengthDoc, int initStyle, Scintilla::IDocument *buffer) {
+  auto &runs = host->runs;
+
+  // Call lexer._build_grammar(lex, init_style).
+  lua_pushcfunction(L, lua_error_handler);
+  lua_getfield(L, LUA_REGISTRYINDEX, "_LOADED"), lua_getfield(L, -1, "lexer");
+  lua_getfield(L, -1, "_build_grammar"), lua_replace(L, -3), lua_pop(L, 1);
+  lua_pushvalue(L, -3);
+  lua_pushinteger(L, initStyle + 1);
+  if (protected_call(L, 2, 1, -4) != LUA_OK) return false; // xpcall(build, msgh, lex, initStyle)
+  if (lua_isnil(L, -1)) { // the lexer has no rules
+    runs.push_back({STYLE_DEFAULT, static_cast<Sci_PositionU>(lengthDoc) + 1});
+    return (lua_pop(L, 2), true); // nil, lua_error_handler
+  }
+  const int grammar = lua_gettop(L);
+  lua_getfield(L, grammar, "match"); // lpeg.match
+
+  // Split lines like lexer.lex() does, at "\r\n", "\r", or "\n", and match each one with
+  // grammar:match(line, 1, offset), whose captures emit style runs directly. Since lexers
+  // that lex line by line style each line independently of the others, keep the styles of
+  // lines that have not changed since the last lex instead.
+  const char *text = buffer->BufferPointer() + startPos;
+  ContextField ctxLineOffset{host->context.lineOffset, Sci_PositionU{0}};
+  for (Sci_Position offset = 0, end = 0; offset < lengthDoc; offset = end) {
+    while (end < lengthDoc && text[end] != '\r' && text[end] != '\n') end++;
+    if (end < lengthDoc && text[end++] == '\r' && end < lengthDoc && text[end] == '\n') end++;
+    if (LineUnchanged(styler, buffer, startPos + offset, startPos + end)) {
+      for (Sci_Position i = offset; i < end; i++)
+        if (i + 1 == end || styler.StyleAt(startPos + i + 1) != styler.StyleAt(startPos + i))
+          runs.push_back({static_cast<unsigned char>(styler.StyleAt(startPos + i)),
+            static_cast<Sci_PositionU>(i) + 2}); // run end is 1-based and exclusive
+      continue;
+    }
+    if (host->profiling) host->lexTiming.processed += end - offset;
+    host->context.lineOffset = offset;
+    lua_pushvalue(L, -1), lua_pushvalue(L, grammar);
+    lua_pushlstring(L, text + offset, end - offset);
+    lua_pushinteger(L, 1), lua_pushinteger(L, offset);
+    if (protected_call(L, 4, 0, grammar - 1) != LUA_OK) return false;
+    // Use the default style to the end of the line if the lexer did not style all of it.
+    if (runs.empty() || runs.back().end < static_cast<Sci_PositionU>(end) + 1)
+      runs.push_back({STYLE_DEFAULT, static_cast<Sci_PositionU>(end) + 1});
+  }
+  lua_pop(L, 3); // lpeg.match, grammar, lua_error_handler
+  return true;
 }
 
 void Scintillua::Fold(
   Sci_PositionU startPos, Sci_Position lengthDoc, int, Scintilla::IDocument *buffer) {
   Lexilla::LexAccessor styler(buffer);
-  DeferLuaStackCheck checker{L.get()};
-  LuaRegistryField regBuf{L.get(), "buffer", buffer}; // REGISTRY.buffer = buffer
-  LuaRegistryField regStartPos{L.get(), "startPos", startPos}; // REGISTRY.startPos = startPos
+  const auto lock = LockHost();
+  // Do not fold text that Lex() left unstyled because it exceeded its time budget.
+  if (lexStop > startPos && lexStop < startPos + lengthDoc) lengthDoc = lexStop - startPos;
+  ProfileTimer timer{host->profiling ? &host->foldTiming : nullptr, lengthDoc};
+  DeferLuaStackCheck checker{L};
+  ContextField ctxLexer{host->context.lexer, this};
+  ContextField ctxBuffer{host->context.buffer, buffer};
+  ContextField ctxStartPos{host->context.startPos, startPos};
 
   // Call lexer.fold(lex, text, start_pos, start_line, start_level).
-  lua_getfield(L.get(), LUA_REGISTRYINDEX, "lex"); // lex = REGISTRY.lex
-  if (lua_getfield(L.get(), -1, "fold") != LUA_TFUNCTION)
+  lua_getfield(L, LUA_REGISTRYINDEX, "lex"); // lex = REGISTRY.lex
+  if (lua_getfield(L, -1, "fold") != LUA_TFUNCTION)
     return LogError("cannot find lexer.fold()");
-  lua_pushcfunction(L.get(), lua_error_handler), lua_insert(L.get(), -2);
-  lua_pushvalue(L.get(), -3);
+
+  // Fold natively unless the lexer has its own folder.
+  lua_getfield(L, LUA_REGISTRYINDEX, "_LOADED"), lua_getfield(L, -1, "lexer");
+  lua_getfield(L, -1, "fold"); // _LOADED['lexer'].fold
+  const bool defaultFold = lua_rawequal(L, -1, -4);
+  lua_pop(L, 3); // _LOADED['lexer'].fold, _LOADED['lexer'], _LOADED
+  if (defaultFold) {
+    lua_pop(L, 2); // lex.fold, lex
+    std::vector<std::pair<Sci_Position, int>> folds;
+    const bool ok = FoldText(styler, startPos, lengthDoc, buffer, folds);
+    unchangedPos = 0;
+    if (!ok) return;
+    for (const auto &[line, level] : folds)
+      if (styler.LevelAt(line) != level) styler.SetLevel(line, level);
+    return;
+  }
+  if (host->profiling) host->foldTiming.processed += lengthDoc;
+  lua_pushcfunction(L, lua_error_handler), lua_insert(L, -2);
+  lua_pushvalue(L, -3);
   const Sci_Position currentLine = styler.GetLine(startPos);
-  lua_pushlstring(L.get(), buffer->BufferPointer() + startPos, lengthDoc);
-  lua_pushinteger(L.get(), currentLine + 1);
-  lua_pushinteger(L.get(), styler.LevelAt(currentLine) & SC_FOLDLEVELNUMBERMASK);
-  if (lua_pcall(L.get(), 4, 1, -6) != LUA_OK) // t = xpcall(lexer.fold, msgh, lex, txt, ln, lvl)
-    return LogError();
-  lua_remove(L.get(), -2); // lua_error_handler
-  lua_remove(L.get(), -2); // lex
-  if (!lua_istable(L.get(), -1)) return LogError("table of folds expected from lexer.fold()");
+  BufferView *view = push_buffer_view(L, buffer->BufferPointer() + startPos, lengthDoc);
+  lua_pushinteger(L, currentLine + 1);
+  lua_pushinteger(L, styler.LevelAt(currentLine) & SC_FOLDLEVELNUMBERMASK);
+  const int status = protected_call(L, 4, 1, -6); // t = xpcall(lexer.fold, msgh, lex, view, ...)
+  *view = {nullptr, 0};
+  if (status != LUA_OK) return LogError();
+  lua_remove(L, -2); // lua_error_handler
+  lua_remove(L, -2); // lex
+  if (!lua_istable(L, -1)) return LogError("table of folds expected from lexer.fold()");
 
   // Fold the text from the returned table of fold levels.
-  for (lua_pushnil(L.get()); lua_next(L.get(), -2); lua_pop(L.get(), 1)) // {line = level}
-    styler.SetLevel(lua_tointeger(L.get(), -2) - 1, lua_tointeger(L.get(), -1)); // line is 1-based
-  lua_pop(L.get(), 1); // fold table
+  // Note: folders may return levels for any lines, so the table is not necessarily a sequence.
+  for (lua_pushnil(L); lua_next(L, -2); lua_pop(L, 1)) { // {line = level}
+    const Sci_Position line = lua_tointeger(L, -2) - 1; // line is 1-based
+    const int level = lua_tointeger(L, -1);
+    if (styler.LevelAt(line) != level) styler.SetLevel(line, level);
+  }
+  lua_pop(L, 1); // fold table
+}
+
+void Scintillua::LoadFoldPoints() {
+  auto &fp = host->foldPoints;
+  fp.loaded = true;
+  DeferLuaStackCheck checker{L};
+  lua_getfield(L, LUA_REGISTRYINDEX, "lex"); // lex = REGISTRY.lex
+  fp.byIndentation = (lua_getfield(L, -1, "_fold_by_indentation"), lua_toboolean(L, -1));
+  fp.caseInsensitive = (lua_getfield(L, -2, "_case_insensitive_fold_points"), lua_toboolean(L, -1));
+  lua_pop(L, 2); // lex._case_insensitive_fold_points, lex._fold_by_indentation
+  if (lua_getfield(L, -1, "_fold_points") != LUA_TTABLE) return lua_pop(L, 2); // lex._fold_points
+  fp.exist = true;
+
+  lua_getfield(L, -1, "_symbols"); // lex._fold_points._symbols
+  for (int i = 1; lua_rawgeti(L, -1, i) == LUA_TSTRING; lua_pop(L, 1), i++) {
+    const std::string &symbol = fp.symbols.emplace_back(lua_tostring(L, -1));
+    fp.wordSymbols.push_back(std::all_of(symbol.begin(), symbol.end(),
+      [](unsigned char ch) { return isalnum(ch) || ch == '_'; }));
+    if (!symbol.empty()) fp.firstBytes[static_cast<unsigned char>(symbol[0])] = true;
+  }
+  lua_pop(L, 2); // nil, lex._fold_points._symbols
+
+  // Resolve each style's fold points like lexer.fold() does with the style's name.
+  fp.points.resize(STYLE_MAX * fp.symbols.size());
+  lua_newtable(L); // fold functions
+  for (int style = 0; style < STYLE_MAX; style++) {
+    const std::string name = host->StyleName(style);
+    if (lua_getfield(L, -2, name.c_str()) != LUA_TTABLE && name.find('.') != std::string::npos)
+      lua_pop(L, 1), lua_getfield(L, -2, name.substr(0, name.find('.')).c_str());
+    if (lua_istable(L, -1))
+      for (size_t i = 0; i < fp.symbols.size(); i++) {
+        auto &point = fp.points[style * fp.symbols.size() + i];
+        const int type = lua_getfield(L, -1, fp.symbols[i].c_str()); // level = symbols[symbol]
+        if (type == LUA_TNUMBER)
+          point = {LexerHost::FoldPoints::Level, static_cast<int>(lua_tointeger(L, -1))};
+        else if (type == LUA_TFUNCTION) {
+          const int index = lua_rawlen(L, -3) + 1;
+          lua_pushvalue(L, -1), lua_rawseti(L, -4, index);
+          point = {LexerHost::FoldPoints::Function, index}, fp.functions = true;
+        }
+        lua_pop(L, 1); // level
+      }
+    lua_pop(L, 1); // symbols
+  }
+  lua_setfield(L, LUA_REGISTRYINDEX, "fold_functions"); // REGISTRY.fold_functions = functions
+  lua_pop(L, 2); // lex._fold_points, lex
+}
+
+bool Scintillua::FoldText(Lexilla::LexAccessor &styler, Sci_PositionU startPos,
+  Sci_Position lengthDoc, Scintilla::IDocument *buffer,
+  std::vector<std::pair<Sci_Position, int>> &folds) {
+  if (lengthDoc <= 0) return true;
+  if (!host->foldPoints.loaded) LoadFoldPoints();
+  const std::string_view text{buffer->BufferPointer() + startPos, static_cast<size_t>(lengthDoc)};
+  const Sci_Position startLine = styler.GetLine(startPos);
+  const int startLevel = styler.LevelAt(startLine) & SC_FOLDLEVELNUMBERMASK;
+  const bool fold = props.GetInt("fold") > 0;
+  if (fold && host->foldPoints.exist)
+    return FoldByFoldPoints(styler, startPos, text, startLine, startLevel, folds);
+  if (host->profiling) host->foldTiming.processed += text.size();
+  if (fold &&
+    (host->foldPoints.byIndentation || props.GetInt("fold.scintillua.by.indentation") > 0)) {
+    FoldByIndentation(text, startLine, startLevel, buffer, folds);
+    return true;
+  }
+  // No folding, reset fold levels if necessary.
+  Sci_Position line = startLine;
+  for (char ch : text)
+    if (ch == '\n') folds.emplace_back(line++, startLevel);
+  return true;
+}
+
+bool Scintillua::FoldByFoldPoints(Lexilla::LexAccessor &styler, Sci_PositionU startPos,
+  std::string_view text, Sci_Position startLine, int startLevel,
+  std::vector<std::pair<Sci_Position, int>> &folds) {
+  const auto &fp = host->foldPoints;
+  const bool foldZeroSumLines = props.GetInt("fold.scintillua.on.zero.sum.lines") > 0;
+  const bool foldCompact = props.GetInt("fold.scintillua.compact") > 0;
+  const auto isWordChar = [](unsigned char ch) { return isalnum(ch) || ch == '_'; };
+  int textIndex = 0; // stack index of text view for function fold points, if pushed
+  BufferView *textView = nullptr;
+  // Views may outlive this call if a fold function keeps a reference, so invalidate them.
+  const auto invalidateView = [&]() {
+    if (textView) *textView = {nullptr, 0};
+  };
+  std::string lowered; // line in lower case for case-insensitive fold points
+  std::vector<std::pair<size_t, size_t>> ranges; // ranges of matched symbols in a line
+  Sci_Position lineNum = startLine;
+  int prevLevel = startLevel, currentLevel = prevLevel;
+  // Lines from where the last Lex() kept styles on have the same text and styles as when they
+  // were last folded. A line's level depends only on those and its starting level, which the
+  // level determines (even for headers and zero-sum lines), so once one of these lines folds to
+  // the level it already has, so do all the lines after it. Fold functions may also look at the
+  // previous line, so for lexers with them, that line must be one of these lines too.
+  const Sci_Position unchangedLine =
+    unchangedPos ? styler.GetLine(unchangedPos) + (fp.functions ? 1 : 0) : PTRDIFF_MAX;
+  const auto unchanged = [&](int level) {
+    return lineNum >= unchangedLine && lineNum > startLine && styler.LevelAt(lineNum) == level;
+  };
+  // Note: like lexer.fold(), lines end in "\n" or "\r\n", and the last line may be empty.
+  size_t pos = 0;
+  for (size_t eol; pos <= text.size(); pos = eol + 1, lineNum++) {
+    eol = std::min(text.find('\n', pos), text.size());
+    std::string_view line = text.substr(pos, eol - pos);
+    if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+    if (line.empty()) {
+      const int level = prevLevel + (foldCompact ? SC_FOLDLEVELWHITEFLAG : 0);
+      if (unchanged(level)) break;
+      folds.emplace_back(lineNum, level);
+      continue;
+    }
+    if (fp.caseInsensitive) {
+      lowered.assign(line);
+      for (char &ch : lowered)
+        if (ch >= 'A' && ch <= 'Z') ch = ch - 'A' + 'a';
+      line = lowered;
+    }
+
+    // Only search for symbols whose first byte is in the line.
+    bool bytes[256] = {};
+    for (unsigned char ch : line)
+      if (fp.firstBytes[ch]) bytes[ch] = true;
+    ranges.clear();
+    bool levelDecreased = false;
+    for (size_t i = 0; i < fp.symbols.size(); i++) {
+      const std::string &symbol = fp.symbols[i];
+      if (symbol.empty() || !bytes[static_cast<unsigned char>(symbol[0])]) continue;
+      for (size_t s = line.find(symbol); s != std::string_view::npos;
+           s = line.find(symbol, s + 1)) {
+        // Stop at the first occurrence that overlaps a previously matched symbol.
+        const size_t e = s + symbol.size() - 1;
+        if (std::any_of(ranges.begin(), ranges.end(), [&](const auto &range) {
+              return (s >= range.first && s <= range.second) ||
+                (e >= range.first && e <= range.second);
+            }))
+          break;
+        ranges.emplace_back(s, e);
+        if (fp.wordSymbols[i] &&
+          ((s > 0 && isWordChar(line[s - 1])) || (e + 1 < line.size() && isWordChar(line[e + 1]))))
+          continue;
+        const int style = static_cast<unsigned char>(styler.StyleAt(startPos + pos + s));
+        const auto &point = fp.points[style * fp.symbols.size() + i];
+        if (point.kind == LexerHost::FoldPoints::None) continue;
+        int level = point.value;
+        if (point.kind == LexerHost::FoldPoints::Function) {
+          // level = fold_functions[index](text, pos, line, s, symbol)
+          if (!textIndex) {
+            textView = push_buffer_view(L, text.data(), text.size()), textIndex = lua_gettop(L);
+          }
+          lua_pushcfunction(L, lua_error_handler);
+          lua_getfield(L, LUA_REGISTRYINDEX, "fold_functions");
+          lua_rawgeti(L, -1, point.value), lua_replace(L, -2);
+          lua_pushvalue(L, textIndex);
+          lua_pushinteger(L, pos + 1); // convert to 1-based
+          lua_pushlstring(L, line.data(), line.size());
+          lua_pushinteger(L, s + 1); // convert to 1-based
+          lua_pushstring(L, symbol.c_str());
+          if (protected_call(L, 5, 1, -7) != LUA_OK) return (invalidateView(), LogError(), false);
+          if (lua_type(L, -1) != LUA_TNUMBER) {
+            lua_pop(L, 2); // level, lua_error_handler
+            continue;
+          }
+          level = lua_tointeger(L, -1);
+          lua_pop(L, 2); // level, lua_error_handler
+        }
+        currentLevel += level;
+        // Potential zero-sum line. If the level were to go back up on the same line, the line
+        // may be marked as a fold header.
+        if (level < 0 && currentLevel < prevLevel) levelDecreased = true;
+      }
+    }
+
+    int level = prevLevel;
+    if (currentLevel > prevLevel)
+      level = prevLevel + SC_FOLDLEVELHEADERFLAG;
+    else if (levelDecreased && currentLevel == prevLevel && foldZeroSumLines) {
+      if (lineNum > startLine)
+        level = prevLevel - 1 + SC_FOLDLEVELHEADERFLAG;
+      else {
+        // Typing within a zero-sum line.
+        level = styler.LevelAt(lineNum) - 1;
+        if (level > SC_FOLDLEVELHEADERFLAG) level -= SC_FOLDLEVELHEADERFLAG;
+        if (level > SC_FOLDLEVELWHITEFLAG) level -= SC_FOLDLEVELWHITEFLAG;
+        level += SC_FOLDLEVELHEADERFLAG;
+        currentLevel++;
+      }
+    }
+    if (unchanged(level)) break;
+    folds.emplace_back(lineNum, level);
+    if (currentLevel < SC_FOLDLEVELBASE) currentLevel = SC_FOLDLEVELBASE;
+    prevLevel = currentLevel;
+  }
+  if (textIndex) invalidateView(), lua_remove(L, textIndex);
+  if (host->profiling) host->foldTiming.processed += std::min(pos, text.size());
+  return true;
+}
+
+void Scintillua::FoldByIndentation(std::string_view text, Sci_Position startLine,
+  int startLevel, Scintilla::IDocument *buffer,
+  std::vector<std::pair<Sci_Position, int>> &folds) {
+  // Calculate indentation per line, or -1 for blank lines. Like lexer.fold(), match lines with
+  // '([\t ]*)([^\r\n]*)\r?\n' against text .. '\n'.
+  std::vector<int> indentation;
+  const size_t len = text.size() + 1;
+  const auto at = [&](size_t i) { return i < text.size() ? text[i] : '\n'; };
+  for (size_t p = 0; p < len;) {
+    size_t i = p, j, k;
+    while (i < len && (at(i) == ' ' || at(i) == '\t')) i++;
+    for (j = i; j < len && at(j) != '\r' && at(j) != '\n'; j++) {}
+    k = j < len && at(j) == '\r' ? j + 1 : j;
+    if (k < len && at(k) == '\n')
+      indentation.push_back(j > i ? static_cast<int>(i - p) : -1), p = k + 1;
+    else
+      p++;
+  }
+
+  // Find the first non-blank line before startLine. If the current line is indented, make
+  // that previous line a header and update the levels of any blank lines inbetween. If the
+  // current line is blank, match the level of the previous non-blank line.
+  int currentLevel = startLevel;
+  const bool blank = indentation.empty() || indentation[0] < 0;
+  for (Sci_Position i = startLine; i >= 0; i--) {
+    int level = buffer->GetLevel(i);
+    if (level >= SC_FOLDLEVELHEADERFLAG) level -= SC_FOLDLEVELHEADERFLAG;
+    if (level < SC_FOLDLEVELWHITEFLAG) {
+      const int indent = buffer->GetLineIndentation(i);
+      if (!blank && indentation[0] > indent) {
+        folds.emplace_back(i, SC_FOLDLEVELBASE + indent + SC_FOLDLEVELHEADERFLAG);
+        for (Sci_Position j = i + 1; j < startLine; j++)
+          folds.emplace_back(j, startLevel + SC_FOLDLEVELWHITEFLAG);
+      } else if (blank)
+        currentLevel = SC_FOLDLEVELBASE + indent;
+      break;
+    }
+  }
+
+  // Iterate over lines, setting fold numbers and fold flags.
+  std::vector<size_t> nextNonBlank(indentation.size());
+  for (size_t i = indentation.size(), next = indentation.size(); i-- > 0;)
+    nextNonBlank[i] = next, next = indentation[i] >= 0 ? i : next;
+  for (size_t i = 0; i < indentation.size(); i++) {
+    const Sci_Position line = startLine + i;
+    if (indentation[i] < 0) {
+      folds.emplace_back(line, currentLevel + SC_FOLDLEVELWHITEFLAG);
+      continue;
+    }
+    currentLevel = SC_FOLDLEVELBASE + indentation[i];
+    const size_t j = nextNonBlank[i];
+    if (j < indentation.size() && SC_FOLDLEVELBASE + indentation[j] > currentLevel)
+      folds.emplace_back(line, currentLevel + SC_FOLDLEVELHEADERFLAG),
+        currentLevel = SC_FOLDLEVELBASE + indentation[j]; // for any blanks below
+    else
+      folds.emplace_back(line, currentLevel);
+  }
 }
 
 void *SCI_METHOD Scintillua::PrivateCall(int operation, void *pointer) {
   if (operation != SCLUA_DETECT) return (LogError("invalid private call operation"), nullptr);
   if (pointer)
     return (memcpy(pointer, privateCallResult.c_str(), privateCallResult.size()), nullptr);
-  DeferLuaStackCheck checker{L.get()};
-  lua_getfield(L.get(), LUA_REGISTRYINDEX, "_LOADED"), lua_getfield(L.get(), -1, "lexer"),
-    lua_replace(L.get(), -2); // _LOADED['lexer']
-  if (!lua_istable(L.get(), -1)) return (LogError("cannot find lexer module"), nullptr);
-  if (lua_getfield(L.get(), -1, "detect") != LUA_TFUNCTION)
+  const auto lock = LockHost();
+  DeferLuaStackCheck checker{L};
+  ContextField ctxLexer{host->context.lexer, this};
+  lua_getfield(L, LUA_REGISTRYINDEX, "_LOADED"), lua_getfield(L, -1, "lexer"),
+    lua_replace(L, -2); // _LOADED['lexer']
+  if (!lua_istable(L, -1)) return (LogError("cannot find lexer module"), nullptr);
+  if (lua_getfield(L, -1, "detect") != LUA_TFUNCTION)
     return (LogError("cannot find lexer.detect()"), nullptr);
-  lua_pushcfunction(L.get(), lua_error_handler), lua_insert(L.get(), -2);
-  if (lua_pcall(L.get(), 0, 1, -2) != LUA_OK) // lexer_name = xpcall(lexer.detect)
+  lua_pushcfunction(L, lua_error_handler), lua_insert(L, -2);
+  if (protected_call(L, 0, 1, -2) != LUA_OK) // lexer_name = xpcall(lexer.detect)
     return (LogError(), nullptr);
-  lua_remove(L.get(), -2); // lua_error_handler
-  const char *lexer_name = lua_tostring(L.get(), -1);
+  lua_remove(L, -2); // lua_error_handler
+  const char *lexer_name = lua_tostring(L, -1);
   privateCallResult = lexer_name ? lexer_name : "";
-  lua_pop(L.get(), 2); // lexer_name, _LOADED['lexer']
+  lua_pop(L, 2); // lexer_name, _LOADED['lexer']
   return reinterpret_cast<void *>(static_cast<uintptr_t>(privateCallResult.size()));
 }
 
+void Scintillua::LoadStyles() {
+  DeferLuaStackCheck checker{L};
+  host->styleNames.clear();
+  lua_getfield(L, LUA_REGISTRYINDEX, "lex"); // lex = REGISTRY.lex
+  lua_getfield(L, -1, "_TAGS"); // lex._TAGS
+  host->numStyles = lua_rawlen(L, -1); // #lex._TAGS
+  for (int style = FixedTagCount; style < host->numStyles; style++) {
+    lua_rawgeti(L, -1, style + 1); // name = lex._TAGS[style], which is 1-based
+    host->styleNames.emplace_back(lua_isstring(L, -1) ? lua_tostring(L, -1) : "Unknown");
+    lua_pop(L, 1); // name
+  }
+  lua_pop(L, 2); // lex._TAGS, lex
+  // Note: style 0 is the "whitespace" tag, which Lua lexers do not use, and which inserted text
+  // has until it is lexed.
+  for (int style = 0; style < STYLE_MAX; style++)
+    host->ws[style] = strncmp(host->StyleName(style), "whitespace.", 11) == 0;
+  host->tagStyles.clear();
+  for (size_t i = 0; i < host->tagNames.size(); i++)
+    tag_style(L, host.get(), FixedTagCount + i + 1); // tag ids are 1-based
+}
+
 // Note: includes the names of predefined styles.
 int Scintillua::NamedStyles() {
-  DeferLuaStackCheck checker{L.get()};
-  lua_getfield(L.get(), LUA_REGISTRYINDEX, "lex"); // lex = REGISTRY.lex
-  lua_getfield(L.get(), -1, "_TAGS"); // lex._TAGS
-  const int num = lua_rawlen(L.get(), -1); // #lex._TAGS
-  lua_pop(L.get(), 2); // lex._TAGS, lex
-  return num;
+  const auto lock = LockHost();
+  return host ? host->numStyles : 0;
 }
 
 const char *Scintillua::NameOfStyle(int style) {
-  styleName = "Unknown";
-  DeferLuaStackCheck checker{L.get()};
-  lua_getfield(L.get(), LUA_REGISTRYINDEX, "lex"); // lex = REGISTRY.lex
-  lua_getfield(L.get(), -1, "_TAGS"); // lex._TAGS
-  if (lua_rawgeti(L.get(), -1, style + 1)) // style in _TAGS is 1-based
-    styleName = lua_tostring(L.get(), -1); // name = lex._TAGS[style]
-  lua_pop(L.get(), 3); // name, lex._TAGS, lex
+  const auto lock = LockHost();
+  if (host) styleName = host->StyleName(style);
+  else styleName = style >= 0 && style < FixedTagCount ? FixedTags[style] : "Unknown";
   return styleName.c_str();
 }
 
-const char *Scintillua::PropertyGet(const char *key) { return props.Get(key); }
+const char *Scintillua::PropertyGet(const char *key) {
+  if (host && strcmp(key, StatsKey) == 0) props.Set(key, ProfileStats().c_str());
+  if (host && strcmp(key, MemoryCurrentKey) == 0)
+    props.Set(key, std::to_string(host->allocator.current.load()).c_str());
+  if (host && strcmp(key, MemoryPeakKey) == 0)
+    props.Set(key, std::to_string(host->allocator.peak.load()).c_str());
+  return props.Get(key);
+}
+
+void Scintillua::SetLexerProperty(const char *key, const char *value) {
+  if (host) host->lexerProps[key] = value;
+  PropertySet(key, value);
+}
+
+size_t Scintillua::DetectLexers(ScintilluaFile *files, size_t count, std::set<std::string> &names) {
+  for (size_t i = 0; i < count; i++) files[i].lexer = nullptr;
+  const auto lock = LockHost();
+  if (!host) return 0;
+  DeferLuaStackCheck checker{L};
+  ContextField ctxLexer{host->context.lexer, this};
+  lua_getfield(L, LUA_REGISTRYINDEX, "_LOADED"), lua_getfield(L, -1, "lexer"),
+    lua_replace(L, -2); // _LOADED['lexer']
+  if (!lua_istable(L, -1)) return (LogError("cannot find lexer module"), 0);
+  if (lua_getfield(L, -1, "detect_all") != LUA_TFUNCTION)
+    return (LogError("cannot find lexer.detect_all()"), 0);
+  lua_pushcfunction(L, lua_error_handler), lua_insert(L, -2);
+  lua_createtable(L, static_cast<int>(std::min<size_t>(count, INT_MAX)), 0);
+  for (size_t i = 0; i < count; i++) {
+    lua_createtable(L, 2, 0);
+    if (files[i].filename) lua_pushstring(L, files[i].filename), lua_rawseti(L, -2, 1);
+    if (files[i].line) lua_pushstring(L, files[i].line), lua_rawseti(L, -2, 2);
+    lua_rawseti(L, -2, i + 1); // files[i + 1] = {filename, line}
+  }
+  if (protected_call(L, 1, 1, -3) != LUA_OK) // names = xpcall(lexer.detect_all, msgh, files)
+    return (LogError(), 0);
+  lua_remove(L, -2); // lua_error_handler
+  size_t detected = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (lua_rawgeti(L, -1, i + 1) == LUA_TSTRING) // names[i + 1]
+      files[i].lexer = names.emplace(lua_tostring(L, -1)).first->c_str(), detected++;
+    lua_pop(L, 1); // names[i + 1]
+  }
+  lua_pop(L, 2); // names, _LOADED['lexer']
+  return detected;
+}
 
 const char *Scintillua::GetName() { return name.c_str(); }
 
@@ -545,17 +2267,25 @@ EXPORT_FUNCTION const char *CALLING_CONVENTION GetLibraryPropertyNames() {
 }
 
 std::string lexersDir;
+std::mutex lexersDirMutex; // guards lexersDir
 
 EXPORT_FUNCTION void CALLING_CONVENTION SetLibraryProperty(const char *key, const char *value) {
+  std::lock_guard<std::mutex> lock{lexersDirMutex};
   if (std::string_view{key} == "scintillua.lexers") lexersDir = value;
 }
 
+// Returns a copy of the lexers directory library property.
+std::string LexersDir() {
+  std::lock_guard<std::mutex> lock{lexersDirMutex};
+  return lexersDir;
+}
+
 EXPORT_FUNCTION const char *CALLING_CONVENTION GetNameSpace() { return "scintillua"; }
 
-std::string errorMessage;
+thread_local std::string errorMessage; // per-thread, like errno
 
 EXPORT_FUNCTION Scintilla::ILexer5 *CALLING_CONVENTION CreateLexer(const char *name) {
-  auto lexer = new Scintillua(lexersDir, name);
+  auto lexer = new Scintillua(LexersDir(), name);
   errorMessage = lexer->PropertyGet(Scintillua::LexerErrorKey);
   if (errorMessage.length() > 0) {
     lexer->Release();
@@ -567,6 +2297,62 @@ EXPORT_FUNCTION Scintilla::ILexer5 *CALLING_CONVENTION CreateLexer(const char *n
 EXPORT_FUNCTION const char *CALLING_CONVENTION GetCreateLexerError() {
   return errorMessage.c_str();
 }
+
+EXPORT_FUNCTION size_t CALLING_CONVENTION LexDocuments(
+  ScintilluaDocument *documents, size_t count, int threads) {
+  const std::string dir = LexersDir();
+  if (threads <= 0) threads = std::max(1u, std::thread::hardware_concurrency());
+  if (static_cast<size_t>(threads) > count) threads = count;
+  std::atomic<size_t> next{0}, lexed{0};
+  // Each worker has its own host group, and thus its own Lua states. Workers create lexers as
+  // needed and keep them for the rest of the call.
+  const auto work = [&](int group) {
+    std::map<std::string, std::unique_ptr<Scintillua>> lexers; // nullptr for failed lexers
+    for (size_t i; (i = next++) < count;) {
+      ScintilluaDocument &document = documents[i];
+      document.ok = 0;
+      auto it = lexers.find(document.lexer);
+      if (it == lexers.end()) {
+        auto lexer = std::make_unique<Scintillua>(dir, document.lexer, group);
+        if (*lexer->PropertyGet(Scintillua::LexerErrorKey)) lexer.reset();
+        it = lexers.emplace(document.lexer, std::move(lexer)).first;
+      }
+      auto &lexer = it->second;
+      if (!lexer) continue;
+      if (document.length > 0) {
+        MemoryDocument buffer{document.text, static_cast<Sci_Position>(document.length),
+          document.styles};
+        lexer->PropertySet(Scintillua::LexerErrorKey, "");
+        lexer->Lex(0, document.length, 0, &buffer);
+        if (*lexer->PropertyGet(Scintillua::LexerErrorKey)) continue;
+      }
+      document.ok = 1, lexed++;
+    }
+  };
+  std::vector<std::thread> workers;
+  for (int i = 1; i < threads; i++) workers.emplace_back(work, i + 1);
+  work(1);
+  for (auto &worker : workers) worker.join();
+  return lexed;
+}
+
+EXPORT_FUNCTION size_t CALLING_CONVENTION DetectLexers(ScintilluaFile *files, size_t count) {
+  // Detection uses a persistent "text" lexer in its own host group so that its detection index
+  // is built once, and so that it does not contend with lexers the application created.
+  static std::mutex mutex;
+  static std::unique_ptr<Scintillua> detector;
+  static std::string detectorDir;
+  static std::set<std::string> names; // detected lexer names
+  std::lock_guard<std::mutex> lock{mutex};
+  if (const std::string dir = LexersDir(); !detector || dir != detectorDir) {
+    detector = std::make_unique<Scintillua>(dir, "text", -1), detectorDir = dir;
+    detector->PropertySet("lexer.scintillua.detect.cache", "1");
+  }
+  const size_t detected = detector->DetectLexers(files, count, names);
+  errorMessage = detector->PropertyGet(Scintillua::LexerErrorKey);
+  if (!errorMessage.empty()) detector.reset(); // try again next time
+  return detected;
+}
 }
 
 } // namespace
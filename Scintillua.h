@@ -4,6 +4,8 @@
 #ifndef SCINTILLUA_H
 #define SCINTILLUA_H
 
+#include <stddef.h>
+
 #define SCLUA_DETECT 1
 
 #ifdef __cplusplus
@@ -20,6 +22,30 @@ const char *GetNameSpace();
 ILEXER5 *CreateLexer(const char *name);
 const char *GetCreateLexerError();
 
+// A document for LexDocuments() to style.
+typedef struct {
+  const char *lexer; // the name of the lexer to use
+  const char *text;
+  size_t length;
+  char *styles; // receives the style number of each of the *length* bytes in *text*
+  int ok; // set to whether or not the document was lexed successfully
+} ScintilluaDocument;
+
+// Lexes the given documents in parallel using up to *threads* threads (or one per core if
+// *threads* is not positive), and returns the number of documents lexed successfully.
+size_t LexDocuments(ScintilluaDocument *documents, size_t count, int threads);
+
+// A file for DetectLexers() to detect the lexer of.
+typedef struct {
+  const char *filename; // the filename, or NULL
+  const char *line; // the first content line, such as a shebang line, or NULL
+  const char *lexer; // receives the name of the detected lexer, or NULL if none was detected
+} ScintilluaFile;
+
+// Detects the lexers of the given files in a single call, and returns the number of files a
+// lexer was detected for. Detected lexer names persist for the life of the library.
+size_t DetectLexers(ScintilluaFile *files, size_t count);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,120 @@
+// Copyright 2006-2024 Mitchell. See LICENSE.
+// Native benchmarks for Scintillua lexers, run by bench.lua. Run from the top-level directory.
+// Usage: bench-native lexer corpus file
+// Lexes, folds, and re-lexes and re-folds an edit in the given file the way Scintilla would
+// have Scintillua do it, writing the results to stdout as JSON objects, one per line, for
+// bench.lua to include in its results.
+// The BENCH_ITERATIONS environment variable changes the number of times each benchmark is
+// run. Results are the fastest of those runs.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "ILexer.h"
+
+#include "Scintilla.h"
+
+#include "Scintillua.h"
+#include "MemoryDocument.h"
+
+namespace {
+
+const char *name, *corpus;
+int iterations = 5;
+
+// Prints the given benchmark's result.
+void result(const char *benchmark, size_t bytes, double seconds) {
+  printf("{\"lexer\": \"%s\", \"benchmark\": \"%s\", \"corpus\": \"%s\", \"bytes\": %zu, "
+         "\"seconds\": %.6f}\n",
+    name, benchmark, corpus, bytes, seconds);
+}
+
+// Returns the fastest time in seconds of the iterations of function *f*, which is passed
+// function *timed* to call with the function whose time to measure.
+template <typename F> double fastest(F f) {
+  double best = 1e300;
+  for (int i = 0; i < iterations; i++)
+    f([&](auto measured) {
+      const auto start = std::chrono::steady_clock::now();
+      measured();
+      const std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - start;
+      best = std::min(best, seconds.count());
+    });
+  return best;
+}
+
+// Returns a new lexer for the benchmarked language with folding enabled, or exits on error.
+Scintilla::ILexer5 *create_lexer() {
+  Scintilla::ILexer5 *lexer = CreateLexer(name);
+  if (!lexer) fprintf(stderr, "%s\n", GetCreateLexerError()), exit(1);
+  lexer->PropertySet("fold", "1");
+  return lexer;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  if (argc != 4) return (fprintf(stderr, "Usage: %s lexer corpus file\n", argv[0]), 1);
+  name = argv[1], corpus = argv[2];
+  if (const char *value = getenv("BENCH_ITERATIONS"); value && atoi(value) > 0)
+    iterations = atoi(value);
+  std::string text;
+  FILE *f = fopen(argv[3], "rb");
+  if (!f) return (fprintf(stderr, "Cannot open %s\n", argv[3]), 1);
+  char buffer[BUFSIZ];
+  for (size_t n; (n = fread(buffer, 1, sizeof(buffer), f)) > 0;) text.append(buffer, n);
+  fclose(f);
+  SetLibraryProperty("scintillua.lexers", "lexers");
+
+  // Lex the whole document with LexDocuments(), which lexes it in a single Lex() call over a
+  // MemoryDocument.
+  std::vector<char> styles(text.size());
+  ScintilluaDocument batch{name, text.data(), text.size(), styles.data(), 0};
+  result("native-lex", text.size(), fastest([&](auto timed) {
+    timed([&]() { LexDocuments(&batch, 1, 1); });
+  }));
+  if (!batch.ok) return (fprintf(stderr, "Cannot lex %s\n", name), 1);
+
+  // Fold the whole document.
+  result("native-fold", text.size(), fastest([&](auto timed) {
+    EditableDocument document{text};
+    Scintilla::ILexer5 *lexer = create_lexer();
+    lexer->Lex(0, document.Length(), 0, &document);
+    timed([&]() { lexer->Fold(0, document.Length(), 0, &document); });
+    lexer->Release();
+  }));
+
+  // Insert a character at the start of the middle line, and re-lex and re-fold from there
+  // to the end of the document. Scintilla asks for the rest of the document when it is idle
+  // styling, and Scintillua stops once the lexer state and fold levels are unchanged.
+  const size_t middle = text.find('\n', text.size() / 2);
+  const Sci_Position pos = middle == std::string::npos ? text.size() : middle + 1;
+  Sci_Position start = 0;
+  const auto edit = [&](EditableDocument &document, Scintilla::ILexer5 *lexer) {
+    lexer->Lex(0, document.Length(), 0, &document);
+    lexer->Fold(0, document.Length(), 0, &document);
+    start = document.Replace(pos, 0, " ");
+  };
+  result("native-relex", text.size() + 1 - pos, fastest([&](auto timed) {
+    EditableDocument document{text};
+    Scintilla::ILexer5 *lexer = create_lexer();
+    edit(document, lexer);
+    timed([&]() { lexer->Lex(start, document.Length() - start, 0, &document); });
+    lexer->Release();
+  }));
+  result("native-refold", text.size() + 1 - pos, fastest([&](auto timed) {
+    EditableDocument document{text};
+    Scintilla::ILexer5 *lexer = create_lexer();
+    edit(document, lexer);
+    lexer->Lex(start, document.Length() - start, 0, &document);
+    timed([&]() { lexer->Fold(start, document.Length() - start, 0, &document); });
+    lexer->Release();
+  }));
+  return 0;
+}
@@ -0,0 +1,228 @@
+-- Copyright 2006-2024 Mitchell. See LICENSE.
+-- Benchmarks for Scintillua lexers.
+-- Usage: lua bench.lua [lexer ...]
+-- Loads each lexer (or only the given ones), and lexes, folds, and re-lexes an edit in a
+-- generated corpus, writing the results to stdout as JSON so runs can be compared across
+-- commits. Progress is written to stderr.
+-- If the bench-native program from bench.cxx has been built, it also runs that over the same
+-- corpus, which benchmarks lexing and folding through Scintillua itself (LexDocuments() and
+-- incremental Lex() and Fold() calls after an edit) rather than in Lua alone.
+-- The BENCH_SIZE and BENCH_ITERATIONS environment variables change the approximate size in
+-- bytes of each corpus document and the number of times each benchmark is run. Results are
+-- the fastest of those runs.
+
+package.path = 'lexers/?.lua;' .. package.path
+
+local lexer = require('lexer')
+lpeg = require('lpeg') -- not local for use by lexers in Lua 5.2+
+
+local clock, format, concat = os.clock, string.format, table.concat
+local SIZE = tonumber(os.getenv('BENCH_SIZE')) or 1024 * 1024
+local ITERATIONS = tonumber(os.getenv('BENCH_ITERATIONS')) or 5
+-- Number of lines after an edit that Scintilla would typically style (roughly a screenful).
+local EDIT_LINES = 50
+-- Native benchmark program, if it has been built.
+local native = io.open('bench-native')
+local NATIVE = native and native:close() and './bench-native'
+
+-- Corpus snippets for specific lexers. Each snippet is repeated until the document is SIZE
+-- bytes, with '@' replaced by the repetition number so that identifiers and numbers vary.
+local snippets = {
+	cpp = [[
+// Computes the checksum of item @.
+#include <vector>
+#define ITEM_@ (@ << 2)
+namespace bench@ {
+template <typename T> struct Item@ {
+  std::vector<T> values{1, 2, 3};
+  /* Returns the sum of all values, or -1 if it is too small. */
+  T sum() const {
+    T total = 0x@;
+    for (const auto &value : values) total += value * 3.14f;
+    if (total > 100) return total; else return -1;
+  }
+};
+const char *name@ = "item \"@\"";
+} // namespace bench@
+]],
+	html = [[
+<!DOCTYPE html>
+<html>
+<head>
+  <style type="text/css">
+    .item@ { color: #ff0000; margin: @px 2em; }
+    /* Comment @. */
+  </style>
+  <script type="text/javascript">
+    function item@(x) { return x * @ + "str" + /re@/g.test(x); } // comment
+  </script>
+</head>
+<body class="item@">
+  <!-- Comment @. -->
+  <p id="p@">Paragraph &amp; text @ <a href="https://example.com/@">link</a></p>
+</body>
+</html>
+]],
+	markdown = [=[
+# Heading @
+
+Some *emphasized* and **strong** text with `code @` and a [link](https://example.com/@).
+
+* List item @
+  1. Nested item
+
+> Quote @
+
+    indented code @
+
+```lua
+local x = @
+```
+
+]=],
+	yaml = [[
+item@:
+  name: "Item @"
+  count: @
+  enabled: true
+  tags: [a, b, c]
+  # Comment @.
+  nested:
+    - key: value@
+      ratio: 3.14
+]],
+	sql = [[
+-- Query @.
+SELECT id, name, COUNT(*) AS total FROM items@ WHERE price > @.5 AND name LIKE 'item%@'
+GROUP BY id ORDER BY total DESC;
+INSERT INTO log@ (id, message) VALUES (@, 'inserted "@"');
+/* Block comment @. */
+]]
+}
+-- Snippet for all other lexers. It contains a mix of common syntax so that most lexers match
+-- more than just identifiers.
+local generic = [[
+# comment @
+// comment @
+-- comment @
+/* comment @ */
+identifier@ = "string @" + 'c' + 123.45e6 * (0x@ - value@);
+if (x@ > 0) { call(x@, [1, 2, 3]); } else { return nil; }
+]]
+
+-- Returns a document of approximately the given size made of the given snippet.
+local function generate(snippet, size)
+	local parts, n = {}, 0
+	while n < size do
+		parts[#parts + 1] = snippet:gsub('@', tostring(#parts + 1))
+		n = n + #parts[#parts]
+	end
+	return concat(parts)
+end
+
+-- Returns the fastest time in seconds of ITERATIONS calls to function *f* with the given
+-- arguments.
+local function time(f, ...)
+	local best = math.huge
+	for _ = 1, ITERATIONS do
+		local start = clock()
+		f(...)
+		best = math.min(best, clock() - start)
+	end
+	return best
+end
+
+-- Returns the position to start re-lexing from after an edit at position *pos* like
+-- Scintillua's Lex() does, along with the style number to start with.
+-- Lex() starts at the beginning of the style before *pos* and, for multilang lexers, at the
+-- whitespace before that.
+local function lex_start(lex, tags, pos)
+	local i = 2
+	while i < #tags and tags[i] <= pos - 1 do i = i + 2 end -- tag i - 1 spans pos - 1
+	if lex._CHILDREN then while i > 2 and not tags[i - 1]:find('^whitespace') do i = i - 2 end end
+	if i == 2 then return 1, lex._TAGS['whitespace.' .. lex._name] end
+	return tags[i - 2], lex._TAGS[tags[i - 3]]
+end
+
+-- Makes lexer.style_at available for folding like Scintilla does, using the given tags from
+-- lexing.
+local function set_style_at(tags)
+	lexer.style_at = setmetatable({}, {
+		__index = function(_, pos)
+			local low, high = 1, #tags // 2 -- find the first tag ending after pos
+			while low < high do
+				local mid = (low + high) // 2
+				if tags[2 * mid] > pos then high = mid else low = mid + 1 end
+			end
+			return tags[2 * low - 1]
+		end
+	})
+end
+
+-- Benchmarks the given lexer, appending results to the given list.
+local function bench(name, results)
+	local function result(benchmark, corpus, bytes, seconds)
+		results[#results + 1] = format(
+			'{"lexer": "%s", "benchmark": "%s", "corpus": "%s", "bytes": %d, "seconds": %.6f}', name,
+			benchmark, corpus, bytes, seconds)
+	end
+
+	local ok, lex = pcall(lexer.load, name)
+	if not ok then
+		io.stderr:write(format('Skipping %s: %s\n', name, lex))
+		return
+	end
+	lexer.property['fold'] = '1' -- lexer.load() initializes lexer.property
+	-- Lexer creation includes building its grammar, which normally happens on first lex.
+	result('load', '', 0, time(function() lexer.load(name):lex('') end))
+
+	local corpus = snippets[name] and name or 'generic'
+	local text = generate(snippets[name] or generic, snippets[name] and SIZE or SIZE / 16)
+	local init_style = lex._TAGS['whitespace.' .. lex._name]
+	result('lex', corpus, #text, time(lex.lex, lex, text, init_style))
+
+	local tags = lex:lex(text, init_style)
+	set_style_at(tags)
+	result('fold', corpus, #text, time(lex.fold, lex, text, 1, lexer.FOLD_BASE))
+
+	-- Insert a character at the start of the middle line and re-lex a screenful of lines from
+	-- where Lex() would start.
+	local pos = text:find('\n', #text // 2, true) + 1
+	local original = text
+	text = text:sub(1, pos - 1) .. ' ' .. text:sub(pos)
+	local start, style = lex_start(lex, tags, pos)
+	local e = pos
+	for _ = 1, EDIT_LINES do e = (text:find('\n', e, true) or #text) + 1 end
+	local range = text:sub(start, e - 1)
+	result('relex', corpus, #range, time(lex.lex, lex, range, style))
+
+	-- Run the native benchmarks over the unedited corpus.
+	if not NATIVE then return end
+	local filename = os.tmpname()
+	local f = assert(io.open(filename, 'wb'))
+	f:write(original)
+	f:close()
+	local p = io.popen(format('%s %s %s %s', NATIVE, name, corpus, filename))
+	for line in p:lines() do results[#results + 1] = line end
+	p:close()
+	os.remove(filename)
+end
+
+local names = {}
+if #arg == 0 then
+	local p = io.popen('ls lexers/*.lua')
+	for filename in p:lines() do
+		local name = filename:match('([^/]+)%.lua$')
+		if name ~= 'lexer' then names[#names + 1] = name end
+	end
+	p:close()
+else
+	for i = 1, #arg do names[i] = arg[i] end
+end
+local results = {}
+for _, name in ipairs(names) do
+	io.stderr:write(format('Benchmarking %s.\n', name))
+	bench(name, results)
+end
+print(format('{"version": "%s", "size": %d, "iterations": %d, "results": [\n  %s\n]}',
+	_VERSION, SIZE, ITERATIONS, concat(results, ',\n  ')))
@@ -0,0 +1,34 @@
+#!/usr/bin/lua
+-- Generates lexers/lexers.bundle, a bundle of precompiled lexer.lua and lexers that Scintillua
+-- loads instead of parsing lexer source files.
+-- This must be run with the same version of Lua that Scintillua is compiled with. Otherwise
+-- Scintillua ignores the bundle. Scintillua also ignores a bundled lexer if its source file
+-- has changed since the bundle was generated.
+
+local format, concat = string.format, table.concat
+
+-- Returns the 32-bit FNV-1a hash of string s.
+local function hash(s)
+	local h = 2166136261
+	for i = 1, #s do h = ((h ~ s:byte(i)) * 16777619) & 0xFFFFFFFF end
+	return h
+end
+
+local index, chunks = {}, {}
+local offset = 0
+local p = io.popen('ls lexers/*.lua')
+for filename in p:lines() do
+	local f = io.open(filename, 'rb')
+	local source = f:read('a')
+	f:close()
+	local chunk = string.dump(assert(load(source, '@' .. filename)))
+	index[#index + 1] = format('%s %d %d %d %d', filename:match('([^/]+)%.lua$'), #source,
+		hash(source), offset, #chunk)
+	chunks[#chunks + 1] = chunk
+	offset = offset + #chunk
+end
+p:close()
+
+local f = io.open('lexers/lexers.bundle', 'wb')
+f:write('scintillua bundle 1\n', concat(index, '\n'), '\n\n', concat(chunks))
+f:close()
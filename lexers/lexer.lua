@@ -326,7 +326,9 @@
 --     local lex = lexer.new(..., {lex_by_line = true})
 --
 -- Now the input text for the lexer is a single line at a time. Keep in mind that line lexers
--- do not have the ability to look ahead to subsequent lines.
+-- do not have the ability to look ahead to subsequent lines. Also, since Scintillua does not
+-- re-lex lines whose text has not changed, a line lexer's tags (and any line states it sets)
+-- should depend only on the text of the line being lexed.
 --
 -- #### Embedded Lexers
 --
@@ -775,12 +777,131 @@ local M = {}
 
 if not lpeg then lpeg = require('lpeg') end -- Scintillua's Lua environment defines _G.lpeg
 local lpeg = lpeg
-local P, R, S, V, B = lpeg.P, lpeg.R, lpeg.S, lpeg.V, lpeg.B
-local Ct, Cc, Cp, Cmt, C = lpeg.Ct, lpeg.Cc, lpeg.Cp, lpeg.Cmt, lpeg.C
 
 lpeg.setmaxstack(2048) -- the default of 400 is too low for complex grammars
 
+-- First sets for first-byte dispatch.
+-- Patterns created by this module's functions and by the LPeg functions lexers are given are
+-- annotated with nodes that describe how to compute the set of bytes that a pattern's non-empty
+-- matches can start with (its first set), and whether or not the pattern can match without
+-- consuming any input. A lexer's first sets are computed by walking its rules' annotations,
+-- along with the grammar rules they reference. Patterns that lexers combine with LPeg's
+-- operators are not annotated, since LPeg's metatable is shared with its other users.
+-- Annotations are conservative: an unannotated pattern may start with any byte and match the
+-- empty string.
+-- Nodes are either leaves (`{first = set, empty = boolean}`) or operations on other nodes:
+-- `{'+', node, node}` (ordered choice), `{'*', node, node}` (sequence), `{'^', node, n}`
+-- (repetition), `{'cmt', node}` (match-time capture), or `{'V', name}` (grammar rule reference).
+local first_nodes = setmetatable({}, {__mode = 'k'}) -- pattern --> node
+local ALL_BYTES = {}
+for byte = 0, 255 do ALL_BYTES[byte] = true end
+local UNKNOWN = {first = ALL_BYTES, empty = true}
+local NO_INPUT = {first = {}, empty = true} -- for predicates and captures that consume nothing
+
+--- Returns the first set node for value *v*, which LPeg would convert into a pattern.
+local function first_node(v)
+	local t = type(v)
+	if t == 'string' then
+		return #v > 0 and {first = {[v:byte()] = true}, empty = false} or NO_INPUT
+	end
+	if t == 'number' then return v > 0 and {first = ALL_BYTES, empty = false} or NO_INPUT end
+	if t == 'boolean' then return v and NO_INPUT or {first = {}, empty = false} end
+	if t == 'userdata' then return first_nodes[v] or UNKNOWN end
+	return UNKNOWN -- grammars and match-time functions
+end
+
+--- Annotates pattern *patt* with first set node *node* and returns *patt*.
+local function annotate(patt, node)
+	first_nodes[patt] = node
+	return patt
+end
+
+--- Returns a function that calls LPeg function *f* and annotates the resulting pattern with
+-- the node returned by function *node*, which is passed the same arguments as *f*.
+local function annotated(f, node) return function(...) return annotate(f(...), node(...)) end end
+
+local function no_input() return NO_INPUT end
+
+--- LPeg functions that annotate the patterns they create.
+local annotated_lpeg = setmetatable({
+	P = annotated(lpeg.P, first_node),
+	S = annotated(lpeg.S, function(set)
+		local first = {}
+		for i = 1, #set do first[set:byte(i)] = true end
+		return {first = first, empty = false}
+	end),
+	R = annotated(lpeg.R, function(...)
+		local first = {}
+		for i = 1, select('#', ...) do
+			local range = select(i, ...)
+			for byte = range:byte(1), range:byte(2) do first[byte] = true end
+		end
+		return {first = first, empty = false}
+	end),
+	V = annotated(lpeg.V, function(name) return {'V', name} end),
+	Cmt = annotated(lpeg.Cmt, function(patt) return {'cmt', first_node(patt)} end),
+	B = annotated(lpeg.B, no_input), Cc = annotated(lpeg.Cc, no_input),
+	Cp = annotated(lpeg.Cp, no_input), Carg = annotated(lpeg.Carg, no_input),
+	Cb = annotated(lpeg.Cb, no_input), C = annotated(lpeg.C, first_node),
+	Cf = annotated(lpeg.Cf, first_node), Cg = annotated(lpeg.Cg, first_node),
+	Cs = annotated(lpeg.Cs, first_node), Ct = annotated(lpeg.Ct, first_node)
+}, {__index = lpeg})
+local P, R, S, V, B = annotated_lpeg.P, annotated_lpeg.R, annotated_lpeg.S, annotated_lpeg.V,
+	annotated_lpeg.B
+local Ct, Cc, Cp, Cmt, C = annotated_lpeg.Ct, annotated_lpeg.Cc, annotated_lpeg.Cp,
+	annotated_lpeg.Cmt, annotated_lpeg.C
+local Cf, Carg = annotated_lpeg.Cf, annotated_lpeg.Carg
+
+--- Returns a first set node for patterns that start with any of the bytes in string *chars*.
+local function first_of(chars)
+	local first = {}
+	for i = 1, #chars do first[chars:byte(i)] = true end
+	return {first = first, empty = false}
+end
+
+--- Unions byte sets *a* and *b*.
+local function union(a, b)
+	if a == ALL_BYTES or b == ALL_BYTES then return ALL_BYTES end
+	if not next(b) then return a elseif not next(a) then return b end
+	local set = {}
+	for byte in pairs(a) do set[byte] = true end
+	for byte in pairs(b) do set[byte] = true end
+	return set
+end
+
+--- Returns the first set of node *node*, along with whether or not it can match the empty
+-- string, resolving rule references in grammar table *grammar*.
+-- @param cache Table of previously computed results.
+local function first_set(node, grammar, cache)
+	if node.first then return node.first, node.empty end
+	if cache[node] then return cache[node][1], cache[node][2] end
+	cache[node] = {ALL_BYTES, true} -- for recursive rule references
+	local op, first, empty = node[1]
+	if op == 'V' then
+		first, empty = first_set(first_node(grammar[node[2]]), grammar, cache)
+	elseif op == '+' then
+		local first1, empty1 = first_set(node[2], grammar, cache)
+		local first2, empty2 = first_set(node[3], grammar, cache)
+		first, empty = union(first1, first2), empty1 or empty2
+	elseif op == '*' then
+		first, empty = first_set(node[2], grammar, cache)
+		if empty then
+			local first2, empty2 = first_set(node[3], grammar, cache)
+			first, empty = union(first, first2), empty2
+		end
+	elseif op == '^' then
+		first, empty = first_set(node[2], grammar, cache)
+		empty = empty or node[3] <= 0 -- at least 0 or at most -n repetitions
+	else -- 'cmt'
+		first, empty = first_set(node[2], grammar, cache)
+		if empty then first = ALL_BYTES end -- the function may consume input
+	end
+	cache[node] = {first, empty}
+	return first, empty
+end
+
 --- Default tags.
+-- Scintillua has these and the predefined styles below compiled in, so they must stay in order.
 local default = {
 	'whitespace', 'comment', 'string', 'number', 'keyword', 'identifier', 'operator', 'error',
 	'preprocessor', 'constant', 'variable', 'function', 'class', 'type', 'label', 'regex', 'embedded',
@@ -824,12 +945,87 @@ function M.tag(lexer, name, patt)
 		-- the parent lexer.
 		if lexer._lexer then lexer._lexer:tag(name, false) end
 	end
-	return Cc(name) * (P(patt) / 0) * Cp()
+	-- Scintillua's lexer._emit() takes negated tag ids instead of names so that it does not have
+	-- to look up names.
+	local tag = M._tag_id and -M._tag_id(name) or name
+	return annotate(Cc(tag) * (P(patt) / 0) * Cp(), first_node(patt))
 end
 
 --- Returns a unique grammar rule name for the given lexer's i-th word list.
 local function word_list_id(lexer, i) return lexer._name .. '_wordlist' .. i end
 
+--- Returns the set of words in list *word_list* (lowercased if *case_insensitive* is `true`),
+-- a string of the characters other than alphanumerics, '_', and whitespace those words contain,
+-- and the set of bytes those words can start with.
+local function scan_words(word_list, case_insensitive)
+	local words, extra_chars, first = {}, '', {}
+	for _, word in ipairs(word_list) do
+		words[case_insensitive and word:lower() or word] = true
+		for char in word:gmatch('[^%w_%s]') do
+			if not extra_chars:find(char, 1, true) then extra_chars = extra_chars .. char end
+		end
+		local char = word:match('%S')
+		if char then
+			first[char:byte()] = true
+			if case_insensitive then
+				first[char:lower():byte()], first[char:upper():byte()] = true, true
+			end
+		end
+	end
+	return words, extra_chars, first
+end
+
+--- Returns a pattern that matches one word in the given lexer's i-th word list.
+-- Unlike `word_match()`'s patterns, the words this pattern matches are looked up at match time
+-- in a word set that `set_word_list()` can replace in place, so changing the word list does
+-- not require rebuilding the lexer's grammar. The word set is stored in `lexer._WORDLISTS.sets`.
+local function word_set(lexer, i)
+	local list, case_insensitive = lexer._WORDLISTS[i], lexer._WORDLISTS.case_insensitive[i]
+	if list == '' then list = {} end
+	local words, extra_chars, first = scan_words(list, case_insensitive)
+	local set = {words = words, case_insensitive = case_insensitive, first = first}
+	-- Words added later are likely to start with word characters, so allow for them in the
+	-- first set now. Otherwise, adding a word would require rebuilding the grammar for dispatch.
+	local first_chars = {}
+	for byte = 0, 255 do
+		if first[byte] or string.char(byte):find('^[%w_]') then
+			first[byte], first_chars[#first_chars + 1] = true, string.char(byte)
+		end
+	end
+	local patt
+	if M._set_words then
+		set.matcher = M._word_matcher(list, case_insensitive, extra_chars)
+		patt = P(set.matcher)
+	else
+		set.chars = '^[%w_' .. extra_chars:gsub('%p', '%%%0') .. ']+'
+		patt = P(function(input, index)
+			local _, e = input:find(set.chars, index)
+			if not e then return false end
+			local word = input:sub(index, e)
+			return set.words[set.case_insensitive and word:lower() or word] and e + 1
+		end)
+	end
+	if not lexer._WORDLISTS.sets then lexer._WORDLISTS.sets = {} end
+	lexer._WORDLISTS.sets[i] = set
+	-- Avoid calling the match-time function where no word can start.
+	return annotate(#S(table.concat(first_chars)) * patt, {first = first, empty = false})
+end
+
+--- Replaces the words in word set *set* from `word_set()` with those in list *word_list*, and
+-- returns whether or not it was successful.
+-- If a word starts with a byte outside the set's first set, first-byte dispatch would not
+-- try to match it, so the grammar must be rebuilt instead.
+local function update_word_set(set, word_list)
+	local words, extra_chars, first = scan_words(word_list, set.case_insensitive)
+	for byte in pairs(first) do if not set.first[byte] then return false end end
+	if set.matcher then
+		M._set_words(set.matcher, word_list, extra_chars)
+	else
+		set.words, set.chars = words, '^[%w_' .. extra_chars:gsub('%p', '%%%0') .. ']+'
+	end
+	return true
+end
+
 --- Either returns a pattern for lexer *lexer* (if given) that matches one word in the word list
 -- identified by string *word_list*, ignoring case if *case_sensitive* is `true`, or, if *lexer*
 -- is not given, creates and returns a pattern that matches any single word in list or string
@@ -864,7 +1060,7 @@ function M.word_match(lexer, word_list, case_insensitive)
 		local i = lexer._WORDLISTS[word_list] or #lexer._WORDLISTS + 1
 		lexer._WORDLISTS[word_list], lexer._WORDLISTS[i] = i, '' -- empty placeholder word list
 		lexer._WORDLISTS.case_insensitive[i] = case_insensitive
-		return V(word_list_id(lexer, i))
+		return annotate(V(word_list_id(lexer, i)), {'V', word_list_id(lexer, i)})
 	end
 
 	-- Lexer-agnostic word match.
@@ -877,32 +1073,46 @@ function M.word_match(lexer, word_list, case_insensitive)
 	end
 
 	local word_chars = M.alnum + '_'
-	local extra_chars = ''
-	for _, word in ipairs(word_list) do
-		word_list[case_insensitive and word:lower() or word] = true
-		for char in word:gmatch('[^%w_%s]') do
-			if not extra_chars:find(char, 1, true) then extra_chars = extra_chars .. char end
-		end
-	end
+	local words, extra_chars, first = scan_words(word_list, case_insensitive)
 	if extra_chars ~= '' then word_chars = word_chars + S(extra_chars) end
+	local node = {first = first, empty = false}
 
 	-- Optimize small word sets as ordered choice. "Small" is arbitrary.
 	if #word_list <= 6 and not case_insensitive then
 		local choice = P(false)
 		for _, word in ipairs(word_list) do choice = choice + word:match('%S+') end
-		return choice * -word_chars
+		return annotate(choice * -word_chars, node)
 	end
 
-	return Cmt(word_chars^1, function(input, index, word)
+	-- Scintillua can match words natively without creating strings.
+	if M._word_matcher then
+		return annotate(P(M._word_matcher(word_list, case_insensitive, extra_chars)), node)
+	end
+
+	return annotate(Cmt(word_chars^1, function(input, index, word)
 		if case_insensitive then word = word:lower() end
-		return word_list[word]
-	end)
+		return words[word]
+	end), node)
+end
+
+--- Returns the lexer whose word lists `set_word_list()` sets for lexer *lexer*.
+local function word_list_owner(lexer)
+	if lexer._lexer then
+		-- If this lexer is a proxy (e.g. rails), get the true parent (ruby) in order to set the
+		-- parent's word list. If this lexer is a child embedding itself (e.g. php), continue
+		-- setting its word list, not the parent's (html).
+		local parent = lexer._lexer
+		if not parent._CHILDREN or not parent._CHILDREN[lexer] then lexer = parent end
+	end
+	return lexer
 end
 
 --- Sets in lexer *lexer* the word list identified by string or number *name* to string or
 -- list *word_list*, appending to any existing word list if *append* is `true`.
 -- This only has an effect if *lexer* uses `word_match()` to reference the given list.
 -- Case-insensitivity is specified by `word_match()`.
+-- Changing a word list after lexing does not rebuild the lexer's grammar unless a word starts
+-- with a character other than a letter, digit, '_', or the first character of an existing word.
 -- @param lexer The lexer to add the given word list to.
 -- @param name The string name or number of the word list to set.
 -- @param word_list A list of words or a string list of words separated by spaces.
@@ -910,13 +1120,7 @@ end
 --   default value is `false`.
 function M.set_word_list(lexer, name, word_list, append)
 	if word_list == 'scintillua' then return end -- for SciTE
-	if lexer._lexer then
-		-- If this lexer is a proxy (e.g. rails), get the true parent (ruby) in order to set the
-		-- parent's word list. If this lexer is a child embedding itself (e.g. php), continue
-		-- setting its word list, not the parent's (html).
-		local parent = lexer._lexer
-		if not parent._CHILDREN or not parent._CHILDREN[lexer] then lexer = parent end
-	end
+	lexer = word_list_owner(lexer)
 
 	assert(lexer._WORDLISTS, 'lexer has no word lists')
 	local i = tonumber(lexer._WORDLISTS[name]) or name -- lexer._WORDLISTS[name] --> i
@@ -935,9 +1139,21 @@ function M.set_word_list(lexer, name, word_list, append)
 		for _, word in ipairs(word_list) do list[#list + 1] = word end
 	end
 
+	-- Update the word set the grammar matches words in, if possible.
+	local set = lexer._WORDLISTS.sets and lexer._WORDLISTS.sets[i]
+	if set and update_word_set(set, lexer._WORDLISTS[i]) then return end
 	lexer._grammar_table = nil -- invalidate
 end
 
+-- Returns the words in lexer *lexer*'s word list number *i* separated by spaces, or `nil` if
+-- it has no such word list. Scintillua uses this to restore a lexer's own word lists.
+function M._word_list_string(lexer, i)
+	lexer = word_list_owner(lexer)
+	if not lexer._WORDLISTS or i > #lexer._WORDLISTS then return nil end
+	local list = lexer._WORDLISTS[i]
+	return type(list) == 'table' and table.concat(list, ' ') or list
+end
+
 --- Adds pattern *rule* identified by string *id* to the ordered list of rules for lexer *lexer*.
 -- @param lexer The lexer to add the given rule to.
 -- @param id The id associated with this rule. It does not have to be the same as the name
@@ -1031,7 +1247,10 @@ end
 -- `1` (indicating a beginning fold point), `-1` (indicating an ending fold point), or `0`
 -- (indicating no fold point). That function is passed the following arguments:
 --
---   - `text`: The text being processed for fold points.
+--   - `text`: The text being processed for fold points. When folding in Scintilla, this may be
+--     a read-only view of the buffer that supports string methods like `text:sub()`, but is only
+--     valid during the call. Only look at the current and previous lines in it, since Scintillua
+--     stops folding after an edit once lines fold to the levels they already have.
 --   - `pos`: The position in *text* of the beginning of the line currently being processed.
 --   - `line`: The text of the line currently being processed.
 --   - `s`: The position of *start_symbol* in *line*.
@@ -1071,32 +1290,69 @@ function M.add_fold_point(lexer, tag_name, start_symbol, end_symbol)
 	if lexer._lexer then lexer._lexer:add_fold_point(tag_name, start_symbol, end_symbol) end
 end
 
+--- Returns an ordered choice of the rules in the given grammar with the given IDs that, for
+-- each byte, only tries the rules whose first sets include that byte, or nil if that would not
+-- skip any rules.
+-- Bytes are grouped by the rules they could start, and each group tries those rules in their
+-- original order, so the choice matches exactly what trying every rule would.
+-- @param g The grammar whose rules to choose from.
+-- @param ids The list of IDs of the rules to choose from. The last one must match any byte.
+local function dispatch(g, ids)
+	local cache, firsts, empties = {}, {}, {}
+	for i, id in ipairs(ids) do firsts[i], empties[i] = first_set(first_node(g[id]), g, cache) end
+	local groups, list = {}, {} -- map of rule numbers to groups, and list of those groups
+	for byte = 0, 255 do
+		local rules = {}
+		for i = 1, #ids do if empties[i] or firsts[i][byte] then rules[#rules + 1] = i end end
+		local key = table.concat(rules, ' ')
+		local group = groups[key]
+		if not group then
+			group = {rules = rules, bytes = {}}
+			groups[key], list[#list + 1] = group, group
+		end
+		group.bytes[#group.bytes + 1] = string.char(byte)
+	end
+	if #list == 1 then return nil end
+	table.sort(list, function(a, b) return #a.bytes > #b.bytes end) -- try larger groups first
+	local choice = P(false)
+	for _, group in ipairs(list) do
+		local rule = P(false)
+		for _, i in ipairs(group.rules) do rule = rule + V(ids[i]) end
+		choice = choice + #S(table.concat(group.bytes)) * rule
+	end
+	return choice
+end
+
 --- Recursively adds the rules for the given lexer and its children to the given grammar.
 -- @param g The grammar to add rules to.
 -- @param lexer The lexer whose rules to add.
 local function add_lexer(g, lexer)
 	local rule = P(false)
+	local ids = {} -- for dispatch
 
 	-- Add this lexer's rules.
 	for _, name in ipairs(lexer._rules) do
 		local id = rule_id(lexer, name)
 		g[id] = lexer._rules[name] -- ['lua.keyword'] = keyword_patt
 		rule = rule + V(id) -- V('lua.keyword') + V('lua.function') + V('lua.constant') + ...
+		ids[#ids + 1] = id
 	end
 	local any_id = lexer._name .. '_fallback'
 	g[any_id] = lexer:tag(M.DEFAULT, M.any) -- ['lua_fallback'] = any_char
 	rule = rule + V(any_id) -- ... + V('lua.operator') + V('lua_fallback')
+	ids[#ids + 1] = any_id
 
 	-- Add this lexer's word lists.
 	if lexer._WORDLISTS then
 		for i = 1, #lexer._WORDLISTS do
-			local id = word_list_id(lexer, i)
-			local list, case_insensitive = lexer._WORDLISTS[i], lexer._WORDLISTS.case_insensitive[i]
-			local patt = list ~= '' and M.word_match(list, case_insensitive) or P(false)
-			g[id] = patt -- ['lua_wordlist.1'] = word_match_patt or P(false)
+			g[word_list_id(lexer, i)] = word_set(lexer, i) -- ['lua_wordlist.1'] = word_set_patt
 		end
 	end
 
+	-- When Scintillua enables first-byte dispatch, only try the rules that could match the
+	-- next byte.
+	if M._dispatch then rule = dispatch(g, ids) or rule end
+
 	-- Add this child lexer's end rules.
 	if lexer._end_rules then
 		for parent, end_rule in pairs(lexer._end_rules) do
@@ -1141,6 +1397,53 @@ local function add_lexer(g, lexer)
 	end
 end
 
+-- Returns a copy of grammar table *grammar* whose rules record statistics in table *stats*.
+-- For each rule ID, *stats* has a list of the number of times the rule was attempted, the
+-- number of times it matched, the number of bytes it matched, and the number of seconds spent
+-- in it (including in any rules it references).
+local function profile(grammar, stats)
+	local clock = M._clock or os.clock
+	local starts = {} -- stack of positions and times that rules being matched started at
+	local profiled = {grammar[1]}
+	for id, patt in pairs(grammar) do
+		if type(id) == 'string' then
+			local rule_stats = stats[id] or {0, 0, 0, 0}
+			stats[id] = rule_stats
+			local function start(_, i)
+				rule_stats[1] = rule_stats[1] + 1
+				starts[#starts + 1], starts[#starts + 2] = i, clock()
+				return i
+			end
+			local function finish(_, i, matched)
+				local n = #starts
+				if matched then
+					rule_stats[2], rule_stats[3] = rule_stats[2] + 1, rule_stats[3] + i - starts[n - 1]
+				end
+				rule_stats[4] = rule_stats[4] + clock() - starts[n]
+				starts[n], starts[n - 1] = nil, nil
+				return matched and i
+			end
+			-- Note: P(false) keeps the rule from being able to match the empty string if the
+			-- original rule could not.
+			profiled[id] = P(start) *
+				(P(patt) * P(function(s, i) return finish(s, i, true) end) + P(finish) * P(false))
+		end
+	end
+	return profiled
+end
+
+-- Compiles grammar table *grammar* into a pattern that produces a list of tag names and
+-- positions.
+-- When Scintillua provides `lexer._emit()`, the pattern instead folds tag names and positions
+-- directly into Scintillua's style runs. Its first match argument is an offset to add to
+-- positions. When Scintillua enables profiling by providing a `lexer._profile` table, the
+-- pattern's rules record statistics in that table.
+local function compile(grammar)
+	if M._profile then grammar = profile(grammar, M._profile) end
+	if M._emit then return Cf(Carg(1) * P(grammar), M._emit) end
+	return Ct(P(grammar))
+end
+
 --- Returns a grammar for the given lexer and initial rule, (re)constructing it if necessary.
 -- @param lexer The lexer to build a grammar for.
 -- @param init_style The current style. Multiple-language lexers use this to determine which
@@ -1190,35 +1493,39 @@ local function build_grammar(lexer, init_style)
 			--   ['php'] = V('php_rule')^0
 			-- }
 		end
-		lexer._grammar, lexer._grammar_table = Ct(P(grammar)), grammar
+		lexer._grammar, lexer._grammar_table = compile(grammar), grammar
+		lexer._grammars = {[lexer._initial_rule] = lexer._grammar} -- initial rule --> grammar
 	end
 
-	-- For multilang lexers, build a new grammar whose initial rule is the current language
-	-- if necessary. LPeg does not allow a variable initial rule.
-	if lexer._CHILDREN then
-		for style_num, tag in ipairs(lexer._TAGS) do
-			if style_num == init_style then
-				local lexer_name = tag:match('^whitespace%.(.+)$') or lexer._parent_name or lexer._name
-				if lexer._initial_rule == lexer_name then break end
-				if not lexer._grammar_table[lexer_name] then
-					-- For proxy lexers like RHTML, the 'whitespace.rhtml' tag would produce the 'rhtml'
-					-- lexer name, but there is no 'rhtml' rule. It should be the 'html' rule (parent)
-					-- instead.
-					lexer_name = lexer._parent_name or lexer._name
-				end
-				lexer._initial_rule = lexer_name
-				lexer._grammar_table[1] = lexer._initial_rule
-				lexer._grammar = Ct(P(lexer._grammar_table))
-				return lexer._grammar
+	-- For multilang lexers, use a grammar whose initial rule is the current language, building
+	-- it if necessary. LPeg does not allow a variable initial rule, so grammars are cached per
+	-- initial rule until the grammar table is invalidated.
+	local tag = lexer._CHILDREN and lexer._TAGS[init_style]
+	if tag then
+		local lexer_name = tag:match('^whitespace%.(.+)$') or lexer._parent_name or lexer._name
+		if not lexer._grammar_table[lexer_name] then
+			-- For proxy lexers like RHTML, the 'whitespace.rhtml' tag would produce the 'rhtml'
+			-- lexer name, but there is no 'rhtml' rule. It should be the 'html' rule (parent)
+			-- instead.
+			lexer_name = lexer._parent_name or lexer._name
+		end
+		if lexer._initial_rule ~= lexer_name then
+			lexer._initial_rule = lexer_name
+			if not lexer._grammars[lexer_name] then
+				lexer._grammar_table[1] = lexer_name
+				lexer._grammars[lexer_name] = compile(lexer._grammar_table)
 			end
+			lexer._grammar = lexer._grammars[lexer_name]
 		end
 	end
 
 	return lexer._grammar
 end
+M._build_grammar = build_grammar -- for Scintillua to lex line by line natively
 
 --- Lexes a chunk of text *text* (that has an initial style number of *init_style*) using lexer
 -- *lexer*, returning a list of tag names and positions.
+-- When used by Scintillua, tags are emitted directly to Scintillua and the list is empty.
 -- @param lexer The lexer to lex text with.
 -- @param text The text in the buffer to lex.
 -- @param init_style The current style. Multiple-language lexers use this to determine which
@@ -1227,7 +1534,8 @@ end
 function M.lex(lexer, text, init_style)
 	local grammar = build_grammar(lexer, init_style)
 	if not grammar then return {M.DEFAULT, #text + 1} end
-	if M._standalone then M._text, M.line_state = text, {} end
+	if M._standalone then M._text, M.line_state, M._line_starts = text, {}, nil end
+	local emit = M._emit
 
 	if lexer._lex_by_line then
 		local line_from_position = M.line_from_position
@@ -1240,19 +1548,28 @@ function M.lex(lexer, text, init_style)
 		local offset = 0
 		rawset(M, 'line_from_position', function(pos) return line_from_position(pos + offset) end)
 		for line in text:gmatch('[^\r\n]*\r?\n?') do
-			local line_tags = grammar:match(line)
-			if line_tags then append(tags, line_tags, offset) end
-			offset = offset + #line
-			-- Use the default tag to the end of the line if none was specified.
-			if tags[#tags] ~= offset + 1 then
-				tags[#tags + 1], tags[#tags + 2] = 'default', offset + 1
+			local line_tags = grammar:match(line, 1, offset)
+			if emit then
+				-- Use the default tag to the end of the line if none was specified.
+				emit(offset, 'default')
+				emit(offset, #line + 1) -- ignored if the line was fully tagged
+				offset = offset + #line
+			else
+				if line_tags then append(tags, line_tags, offset) end
+				offset = offset + #line
+				-- Use the default tag to the end of the line if none was specified.
+				if tags[#tags] ~= offset + 1 then
+					tags[#tags + 1], tags[#tags + 2] = 'default', offset + 1
+				end
 			end
 		end
 		rawset(M, 'line_from_position', line_from_position)
 		return tags
 	end
 
-	return grammar:match(text)
+	if not emit then return grammar:match(text) end
+	grammar:match(text, 1, 0)
+	return {}
 end
 
 --- Determines fold points in a chunk of text *text* using lexer *lexer*, returning a table of
@@ -1260,7 +1577,9 @@ end
 -- *text* starts on line number *start_line* with a beginning fold level of *start_level*
 -- in the buffer.
 -- @param lexer The lexer to fold text with.
--- @param text The text in the buffer to fold.
+-- @param text The text in the buffer to fold. When folding in Scintilla, lexers with their own
+--   fold() function are passed a read-only view of the buffer like fold functions are (see
+--   `lexer.add_fold_point()`).
 -- @param start_line The line number *text* starts on, counting from 1.
 -- @param start_level The fold level *text* starts on.
 -- @return table of fold levels associated with line numbers.
@@ -1269,7 +1588,7 @@ function M.fold(lexer, text, start_line, start_level)
 	if text == '' then return folds end
 	local fold = M.property_int['fold'] > 0
 	local FOLD_BASE, FOLD_HEADER, FOLD_BLANK = M.FOLD_BASE, M.FOLD_HEADER, M.FOLD_BLANK
-	if M._standalone then M._text, M.line_state = text, {} end
+	if M._standalone then M._text, M.line_state, M._line_starts = text, {}, nil end
 	if fold and lexer._fold_points then
 		local lines = {}
 		for p, l in (text .. '\n'):gmatch('()(.-)\r?\n') do lines[#lines + 1] = {p, l} end
@@ -1410,6 +1729,15 @@ end
 --   - `lex_by_line`: Whether or not the lexer only processes whole lines of text (instead of
 --     arbitrary chunks of text) at a time. Line lexers cannot look ahead to subsequent lines.
 --     The default value is `false`.
+--   - `complete_line_state`: Whether or not the lexer's state at the start of each line is
+--     fully determined by the tag the previous line ends with and the previous line's state
+--     (`lexer.line_state`), even inside a multi-line token. After an edit, Scintillua stops
+--     re-lexing as soon as a line after whitespace starts in the same state as it did before,
+--     and this lets it also stop inside multi-line tokens. Lexers with more than one kind of
+--     multi-line token per tag (e.g. strings with escaped newlines and raw strings), or whose
+--     multi-line tokens end depending on their opening delimiter (e.g. long strings, heredocs,
+--     and code fences), must not set this. Line lexers always have complete line states. The
+--     default value is `false`.
 --   - `fold_by_indentation`: Whether or not the lexer does not define any fold points and that
 --     fold points should be calculated based on changes in line indentation. The default value
 --     is `false`.
@@ -1422,6 +1750,7 @@ end
 function M.new(name, opts)
 	local lexer = setmetatable({
 		_name = assert(name, 'lexer name expected'), _lex_by_line = opts and opts['lex_by_line'],
+		_complete_line_state = opts and opts['complete_line_state'],
 		_fold_by_indentation = opts and opts['fold_by_indentation'],
 		_case_insensitive_fold_points = opts and opts['case_insensitive_fold_points'],
 		_no_user_word_lists = opts and opts['no_user_word_lists'], _lexer = opts and opts['inherit']
@@ -1448,41 +1777,61 @@ local function initialize_standalone_library()
 		__index = function() return '' end, __newindex = function(t, k, v) rawset(t, k, tostring(v)) end
 	})
 
+	-- Returns the start positions of lines in the text being lexed or folded, indexing that text
+	-- on first use.
+	local function line_starts()
+		local starts = M._line_starts
+		if starts then return starts end
+		starts = {1}
+		local text, find = M._text, string.find
+		local pos = find(text, '\n', 1, true)
+		while pos do
+			starts[#starts + 1] = pos + 1
+			pos = find(text, '\n', pos + 1, true)
+		end
+		M._line_starts = starts
+		return starts
+	end
+
 	M.line_from_position = function(pos)
-		local line = 1
-		for s in M._text:gmatch('[^\n]*()') do
-			if pos <= s then return line end
-			line = line + 1
+		local starts = line_starts()
+		local low, high = 1, #starts
+		while low < high do
+			local mid = math.floor((low + high + 1) / 2)
+			if starts[mid] <= pos then low = mid else high = mid - 1 end
 		end
-		return line - 1 -- should not get to here
+		return low
 	end
 
 	M.indent_amount = setmetatable({}, {
 		__index = function(_, line)
-			local current_line = 1
-			for s in M._text:gmatch('()[^\n]*') do
-				if current_line == line then
-					return #M._text:match('^[ \t]*', s):gsub('\t', string.rep(' ', 8))
-				end
-				current_line = current_line + 1
-			end
+			local s = line_starts()[line]
+			if not s then return nil end
+			local indent = M._text:match('^[ \t]*', s)
+			local _, tabs = indent:gsub('\t', '')
+			return #indent + 7 * tabs -- tabs are 8 spaces
 		end
 	})
 
+	-- Each lex or fold is of a new document, so lines have no previous fold levels.
+	M.fold_level = setmetatable({}, {__index = function() return M.FOLD_BASE end})
+
 	M.FOLD_BASE, M.FOLD_HEADER, M.FOLD_BLANK = 0x400, 0x2000, 0x1000
 
 	M._standalone = true
 end
 
---- Searches for the given *name* in the given *path*.
+--- Searches for the given *name* in the given *path* and loads it with environment *env*,
+-- returning the loaded chunk.
 -- This is a safe implementation of Lua 5.2's `package.searchpath()` function that does not
--- require the package module to be loaded.
-local function searchpath(name, path)
+-- require the package module to be loaded. It also loads the file it finds so that the file
+-- is only parsed once.
+local function loadpath(name, path, env)
 	local tried = {}
 	for part in path:gmatch('[^;]+') do
 		local filename = part:gsub('%?', name)
-		local ok, errmsg = loadfile(filename)
-		if ok or not errmsg:find('cannot open') then return filename end
+		local chunk, errmsg = loadfile(filename, 't', env)
+		if chunk or not errmsg:find('cannot open') then return chunk, errmsg end
 		tried[#tried + 1] = string.format("no file '%s'", filename)
 	end
 	return nil, table.concat(tried, '\n')
@@ -1515,11 +1864,13 @@ function M.load(name, alt_name)
 	}, {__index = M})
 	local env = {
 		'assert', 'error', 'ipairs', 'math', 'next', 'pairs', 'print', 'select', 'string', 'table',
-		'tonumber', 'tostring', 'type', 'utf8', '_VERSION', lexer = ro_lexer, lpeg = lpeg, --
+		'tonumber', 'tostring', 'type', 'utf8', '_VERSION', lexer = ro_lexer, lpeg = annotated_lpeg, --
 		require = function() return ro_lexer end -- legacy
 	}
 	for _, name in ipairs(env) do env[name] = _G[name] end
-	local lexer = assert(loadfile(assert(searchpath(name, path)), 't', env))(alt_name or name)
+	local chunk = assert(loadpath(name, path, env))
+	local ok, lexer = pcall(chunk, alt_name or name)
+	if not ok then error(lexer, 0) end
 	assert(lexer, string.format("'%s.lua' did not return a lexer", name))
 
 	-- If the lexer is a proxy or a child that embedded itself, set the parent to be the main
@@ -1579,20 +1930,12 @@ M.detect_extensions = {}
 -- @see detect
 M.detect_patterns = {}
 
---- Returns the name of the lexer often associated with filename *filename* and/or content
--- line *line*.
--- @param[opt] filename Optional string filename. The default value is read from the
---   'lexer.scintillua.filename' property.
--- @param[optchain] line Optional string first content line, such as a shebang line. The default
---   value is read from the 'lexer.scintillua.line' property.
--- @return string lexer name to pass to `load()`, or `nil` if none was detected
--- @see detect_extensions
--- @see detect_patterns
-function M.detect(filename, line)
-	if not filename then filename = M.property and M.property['lexer.scintillua.filename'] or '' end
-	if not line then line = M.property and M.property['lexer.scintillua.line'] or '' end
-
-	-- Locally scoped in order to avoid persistence in memory.
+--- Returns Scintillua's built-in detection index: a map of file extensions to lexer names,
+-- and a list of content line patterns and lexer names.
+-- The index is rebuilt on each call in order to avoid keeping it in memory, unless the
+-- 'lexer.scintillua.detect.cache' property is set.
+local function detection_index()
+	if M._detect_index then return M._detect_index end
 	local extensions = {
 		as = 'actionscript', asc = 'actionscript', --
 		adb = 'ada', ads = 'ada', --
@@ -1754,14 +2097,57 @@ function M.detect(filename, line)
 		['^%s*class%s+%S+%s*<%s*ActiveRecord::Migration'] = 'rails', ['^%s*<%?xml%s'] = 'xml',
 		['^#cloud%-config'] = 'yaml'
 	}
+	local index = {extensions = extensions, patterns = {}}
+	for patt, name in pairs(patterns) do index.patterns[#index.patterns + 1] = {patt, name} end
+	if M.property and (tonumber(M.property['lexer.scintillua.detect.cache']) or 0) > 0 then
+		M._detect_index = index
+	end
+	return index
+end
 
+--- Returns the name of the lexer associated with string filename *filename* and/or string
+-- content line *line* by detection index *index*, or `nil`.
+local function detect(index, filename, line)
 	for patt, name in pairs(M.detect_patterns) do if line:find(patt) then return name end end
-	for patt, name in pairs(patterns) do if line:find(patt) then return name end end
+	for _, patt in ipairs(index.patterns) do if line:find(patt[1]) then return patt[2] end end
 	local name, ext = filename:match('[^/\\]+$'), filename:match('[^.]*$')
+	local extensions = index.extensions
 	return M.detect_extensions[name] or extensions[name] or M.detect_extensions[ext] or
 		extensions[ext]
 end
 
+--- Returns the name of the lexer often associated with filename *filename* and/or content
+-- line *line*.
+-- @param[opt] filename Optional string filename. The default value is read from the
+--   'lexer.scintillua.filename' property.
+-- @param[optchain] line Optional string first content line, such as a shebang line. The default
+--   value is read from the 'lexer.scintillua.line' property.
+-- @return string lexer name to pass to `load()`, or `nil` if none was detected
+-- @see detect_extensions
+-- @see detect_patterns
+function M.detect(filename, line)
+	if not filename then filename = M.property and M.property['lexer.scintillua.filename'] or '' end
+	if not line then line = M.property and M.property['lexer.scintillua.line'] or '' end
+	return detect(detection_index(), filename, line)
+end
+
+--- Returns a list of the names of the lexers often associated with the files in list *files*,
+-- or `false` for files whose lexer was not detected.
+-- This is faster than calling `detect()` for each file since Scintillua's built-in detection
+-- index is only built once.
+-- @param files List of files to detect the lexers of. Each file is a table with an optional
+--   string filename and optional string first content line, like `{filename, line}`.
+-- @return list of lexer names to pass to `load()`, or `false`
+-- @usage lexer.detect_all{{'foo.lua'}, {'foo', '#!/bin/sh'}} --> {'lua', 'bash'}
+-- @see detect
+function M.detect_all(files)
+	local index, names = detection_index(), {}
+	for i, file in ipairs(files) do
+		names[i] = detect(index, file[1] or '', file[2] or '') or false
+	end
+	return names
+end
+
 -- The following are utility functions lexers will have access to.
 
 -- Common patterns.
@@ -1788,37 +2174,45 @@ M.punct = R('!/', ':@', '[\'', '{~')
 --- A pattern that matches any whitespace character ('\t', '\v', '\f', '\n', '\r', space).
 M.space = S('\t\v\f\n\r ')
 
+local non_lf = {} -- first set of nonnewline
+for byte = 0, 255 do if byte ~= 10 then non_lf[byte] = true end end
+
 --- A pattern that matches a sequence of end of line characters.
-M.newline = P('\r')^-1 * '\n'
+M.newline = annotate(P('\r')^-1 * '\n', first_of('\r\n'))
 --- A pattern that matches any single, non-newline character.
-M.nonnewline = 1 - M.newline
+M.nonnewline = annotate(1 - M.newline, {first = non_lf, empty = false})
 
 --- Returns a pattern that matches a decimal number, whose digits may be separated by character
 -- *c*.
-function M.dec_num_(c) return M.digit * (P(c)^-1 * M.digit)^0 end
+function M.dec_num_(c) return annotate(M.digit * (P(c)^-1 * M.digit)^0, first_node(M.digit)) end
 --- Returns a pattern that matches a hexadecimal number, whose digits may be separated by
 -- character *c*.
-function M.hex_num_(c) return '0' * S('xX') * (P(c)^-1 * M.xdigit)^1 end
+function M.hex_num_(c) return annotate('0' * S('xX') * (P(c)^-1 * M.xdigit)^1, first_of('0')) end
 --- Returns a pattern that matches an octal number, whose digits may be separated by character *c*.
-function M.oct_num_(c) return '0' * (P(c)^-1 * R('07'))^1 * -M.xdigit end
+function M.oct_num_(c) return annotate('0' * (P(c)^-1 * R('07'))^1 * -M.xdigit, first_of('0')) end
 --- Returns a pattern that matches a binary number, whose digits may be separated by character *c*.
-function M.bin_num_(c) return '0' * S('bB') * (P(c)^-1 * S('01'))^1 * -M.xdigit end
+function M.bin_num_(c)
+	return annotate('0' * S('bB') * (P(c)^-1 * S('01'))^1 * -M.xdigit, first_of('0'))
+end
 --- Returns a pattern that matches either a decimal, hexadecimal, octal, or binary number,
 -- whose digits may be separated by character *c*.
 function M.integer_(c)
-	return S('+-')^-1 * (M.hex_num_(c) + M.bin_num_(c) + M.oct_num_(c) + M.dec_num_(c))
+	return annotate(S('+-')^-1 * (M.hex_num_(c) + M.bin_num_(c) + M.oct_num_(c) + M.dec_num_(c)),
+		first_of('+-0123456789'))
 end
 local function exp_(c) return S('eE') * S('+-')^-1 * M.digit * (P(c)^-1 * M.digit)^0 end
 --- Returns a pattern that matches a floating point number, whose digits may be separated by
 -- character *c*.
 function M.float_(c)
-	return S('+-')^-1 *
+	return annotate(S('+-')^-1 *
 		((M.dec_num_(c)^-1 * '.' * M.dec_num_(c) + M.dec_num_(c) * '.' * M.dec_num_(c)^-1 * -P('.')) *
-			exp_(c)^-1 + (M.dec_num_(c) * exp_(c)))
+			exp_(c)^-1 + (M.dec_num_(c) * exp_(c))), first_of('+-.0123456789'))
 end
 --- Returns a pattern that matches a typical number, either a floating point, decimal, hexadecimal,
 -- octal, or binary number, and whose digits may be separated by character *c*.
-function M.number_(c) return M.float_(c) + M.integer_(c) end
+function M.number_(c)
+	return annotate(M.float_(c) + M.integer_(c), first_of('+-.0123456789'))
+end
 
 --- A pattern that matches a decimal number.
 M.dec_num = M.dec_num_(false)
@@ -1838,7 +2232,7 @@ M.number = M.number_(false)
 
 --- A pattern that matches a typical word. Words begin with a letter or underscore and consist
 -- of alphanumeric and underscore characters.
-M.word = (M.alpha + '_') * (M.alnum + '_')^0
+M.word = annotate((M.alpha + '_') * (M.alnum + '_')^0, {'+', first_node(M.alpha), first_of('_')})
 
 --- Creates and returns a pattern that matches from string or pattern *prefix* until the end of
 -- the line.
@@ -1851,8 +2245,9 @@ M.word = (M.alpha + '_') * (M.alnum + '_')^0
 -- @usage local line_comment = lexer.to_eol('//')
 -- @usage local line_comment = lexer.to_eol(S('#;'))
 function M.to_eol(prefix, escape)
-	return (prefix or M.nonnewline) *
-		(not escape and M.nonnewline or 1 - (M.newline + '\\') + '\\' * M.any)^0
+	return annotate((prefix or M.nonnewline) *
+		(not escape and M.nonnewline or 1 - (M.newline + '\\') + '\\' * M.any)^0,
+		{'*', first_node(prefix or M.nonnewline), UNKNOWN})
 end
 
 --- Creates and returns a pattern that matches a range of text bounded by strings or patterns *s*
@@ -1887,8 +2282,10 @@ function M.range(s, e, single_line, escapes, balanced)
 	-- Only allow escapes by default for ranges with identical, single-character string delimiters.
 	if escapes == nil then escapes = type(s) == 'string' and #s == 1 and s == e end
 	if escapes then any = any - '\\' + '\\' * M.any end
-	if balanced and s ~= e then return P{s * (any + V(1))^0 * P(e)^-1} end
-	return s * any^0 * P(e)^-1
+	if balanced and s ~= e then
+		return annotate(P{s * (any + V(1))^0 * P(e)^-1}, {'*', first_node(s), UNKNOWN})
+	end
+	return annotate(s * any^0 * P(e)^-1, {'*', first_node(s), UNKNOWN})
 end
 
 --- Creates and returns a pattern that matches pattern *patt* only when it comes after one of
@@ -1904,12 +2301,12 @@ function M.after_set(set, patt, skip)
 	-- Note: cannot use utf8.codes() because Lua 5.1 is still supported.
 	for char in set:gmatch('.') do set_chars[string.byte(char)] = true end
 	for char in skip:gmatch('.') do skip_chars[string.byte(char)] = true end
-	return (B(S(set)) + -B(1)) * patt + Cmt(C(patt), function(input, index, match, ...)
+	return annotate((B(S(set)) + -B(1)) * patt + Cmt(C(patt), function(input, index, match, ...)
 		local pos = index - #match
 		if #skip > 0 then while pos > 1 and skip_chars[input:byte(pos - 1)] do pos = pos - 1 end end
 		if pos == 1 or set_chars[input:byte(pos - 1)] then return index, ... end
 		return nil
-	end)
+	end), {'cmt', first_node(patt)})
 end
 
 --- Creates and returns a pattern that matches pattern *patt* only at the beginning of a line,
@@ -1938,7 +2335,7 @@ M.property_expanded = setmetatable({}, {__index = function() return '' end}) --
 -- @return pattern
 -- @usage local number = token(lexer.NUMBER, lexer.number)
 -- @usage local addition = token('addition', '+' * lexer.word)
-function M.token(name, patt) return Cc(name) * (P(patt) / 0) * Cp() end
+function M.token(name, patt) return annotate(Cc(name) * (P(patt) / 0) * Cp(), first_node(patt)) end
 
 -- Legacy function that creates and returns a pattern that verifies the first non-whitespace
 -- character behind the current match position is in string set *s*.
@@ -1980,6 +2377,11 @@ function M.fold_consecutive_lines() end -- legacy
 --- Table of style names at positions in the buffer starting from 1. (Read-only)
 -- @table style_at
 
+--- Table of style numbers at positions in the buffer starting from 1. (Read-only)
+-- Numbers start from 1 and are the same as those in `lexer._TAGS`, so folders can compare styles
+-- without comparing style names. This table is only available when lexing or folding in Scintilla.
+-- @table style_number_at
+
 --- Returns the line number (starting from 1) of the line that contains position *pos*, which
 -- starts from 1.
 -- @param pos The position to get the line number of.
@@ -0,0 +1,718 @@
+// Copyright 2017-2024 Mitchell. See LICENSE.
+// Unit tests for Scintillua's native lexing and folding. Run from the top-level directory.
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+#include <algorithm>
+#include <filesystem>
+#include <initializer_list>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "ILexer.h"
+
+#include "Scintilla.h"
+
+#include "Scintillua.h"
+#include "MemoryDocument.h"
+
+extern "C" {
+#include "lua.h"
+#include "lualib.h"
+#include "lauxlib.h"
+LUALIB_API int luaopen_lpeg(lua_State *L);
+}
+
+namespace {
+
+// Helper assert functions.
+
+// Raises an error with the given message if *condition* is false.
+#define check(condition) check_at(condition, #condition, __FILE__, __LINE__)
+void check_at(bool condition, const char *expression, const char *file, int line) {
+  if (condition) return;
+  char message[1024];
+  snprintf(message, sizeof(message), "%s:%d: check failed: %s", file, line, expression);
+  throw std::runtime_error{message};
+}
+
+// Returns the position of the first occurrence of *s* in the given document after position
+// *from*.
+Sci_Position find(const EditableDocument &document, const char *s, Sci_Position from = 0) {
+  const size_t pos = document.Text().find(s, from);
+  check(pos != std::string::npos);
+  return pos;
+}
+
+// Creates and returns a lexer for the given language with the given properties, checking that
+// it could be created.
+Scintilla::ILexer5 *create_lexer(
+  const char *name, std::initializer_list<std::pair<const char *, const char *>> props = {}) {
+  Scintilla::ILexer5 *lexer = CreateLexer(name);
+  if (!lexer) fprintf(stderr, "%s\n", GetCreateLexerError());
+  check(lexer != nullptr);
+  for (const auto &[key, value] : props) lexer->PropertySet(key, value);
+  return lexer;
+}
+
+// Asserts that the given lexer did not log an error.
+void check_no_error(Scintilla::ILexer5 *lexer) {
+  const char *error = lexer->PropertyGet("lexer.scintillua.error");
+  if (*error) fprintf(stderr, "%s\n", error);
+  check(*error == '\0');
+}
+
+// Discards the given lexer's statistics, so that processed() only counts what follows.
+void reset_stats(Scintilla::ILexer5 *lexer) {
+  lexer->PropertySet("lexer.scintillua.profile", "1");
+}
+
+// Returns the number of bytes the given lexer actually lexed or folded (rather than kept from
+// before an edit) since its statistics were reset, as reported by them.
+size_t processed(Scintilla::ILexer5 *lexer, const char *what) {
+  std::string format{what};
+  format.append("\t%*s calls\t%*s bytes\t%zu processed");
+  const char *line = lexer->PropertyGet("lexer.scintillua.stats");
+  size_t bytes = 0;
+  while (line && sscanf(line, format.c_str(), &bytes) != 1)
+    if ((line = strchr(line, '\n'))) line++;
+  check(line != nullptr);
+  return bytes;
+}
+
+// Lexes the given range of a document and returns the number of bytes that the lexer actually
+// had to lex.
+size_t lex_counting(Scintilla::ILexer5 *lexer, EditableDocument &document, Sci_Position pos,
+  Sci_Position length) {
+  reset_stats(lexer);
+  lexer->Lex(pos, length, 0, &document);
+  check_no_error(lexer);
+  return processed(lexer, "Lex()");
+}
+
+// Folds the given range of a document and returns the number of bytes that the lexer actually
+// had to fold.
+size_t fold_counting(Scintilla::ILexer5 *lexer, EditableDocument &document, Sci_Position pos,
+  Sci_Position length) {
+  reset_stats(lexer);
+  lexer->Fold(pos, length, 0, &document);
+  check_no_error(lexer);
+  return processed(lexer, "Fold()");
+}
+
+// Returns the fold level of each line in the given document.
+std::vector<int> levels(const EditableDocument &document) {
+  std::vector<int> levels;
+  for (Sci_Position line = 0; line <= document.LineFromPosition(document.Length()); line++)
+    levels.push_back(document.GetLevel(line));
+  return levels;
+}
+
+// Asserts that the given document is styled the same as if it were lexed from scratch, and if
+// *props* are given, folded the same as if it were folded from scratch with them.
+void check_from_scratch(const char *name, const EditableDocument &document,
+  std::initializer_list<std::pair<const char *, const char *>> props = {}) {
+  EditableDocument fresh{document.Text()};
+  Scintilla::ILexer5 *lexer = create_lexer(name, props);
+  lexer->Lex(0, fresh.Length(), 0, &fresh);
+  if (props.size() > 0) lexer->Fold(0, fresh.Length(), 0, &fresh);
+  check_no_error(lexer);
+  lexer->Release();
+  check(document.Styles() == fresh.Styles());
+  if (props.size() > 0) check(levels(document) == levels(fresh));
+}
+
+// Returns the text of a large HTML document with embedded JavaScript and CSS, made of the
+// given number of blocks of about 200 bytes each.
+std::string large_html(int blocks = 2000) {
+  std::string html = "<html>\n<body>\n";
+  for (int i = 0; i < blocks; i++)
+    html.append("<div class=\"block\" id=\"b")
+      .append(std::to_string(i))
+      .append("\">\n"
+              "<p>Some text &amp; <b>more</b> text.</p>\n"
+              "<!-- a comment -->\n"
+              "<script>\n"
+              "var x = 1; // comment\n"
+              "function f() { return 'string'; }\n"
+              "</script>\n"
+              "<style>\n"
+              "p { color: red; }\n"
+              "</style>\n"
+              "</div>\n");
+  return html.append("</body>\n</html>\n");
+}
+
+// Tests.
+
+void test_relex_html_edit_is_bounded() {
+  EditableDocument document{large_html()};
+  Scintilla::ILexer5 *lexer = create_lexer("html");
+  lex_counting(lexer, document, 0, document.Length());
+
+  // Edit embedded JavaScript in the middle of the document. Lexing resumes in JavaScript at the
+  // edited line and stops once a line starts in the same state as before, so only a few lines
+  // are lexed again even though the application asks for the rest of the document.
+  const Sci_Position middle = find(document, "var x = 1", document.Length() / 2);
+  Sci_Position start = document.Replace(middle + 8, 1, "2 + 3");
+  size_t lexed = lex_counting(lexer, document, start, document.Length() - start);
+  check(lexed > 0 && lexed < 256);
+  check_from_scratch("html", document);
+
+  // Edits that change the state of the following lines lex until it is the same again.
+  start = document.Replace(find(document, "<!-- a comment -->", middle) + 4, 0, "-->\n<p>x</p>\n");
+  lexed = lex_counting(lexer, document, start, document.Length() - start);
+  check(lexed > 0 && lexed < 256);
+  check_from_scratch("html", document);
+  start = document.Replace(find(document, "<p>", middle), 0, "<!--");
+  lexed = lex_counting(lexer, document, start, document.Length() - start);
+  check(lexed > 0 && lexed < static_cast<size_t>(document.Length() / 100));
+  check_from_scratch("html", document);
+
+  lexer->Release();
+}
+
+// Returns the text of a large Lua document with nested, zero-sum, and function fold points.
+std::string large_lua() {
+  std::string lua;
+  for (int i = 0; i < 2000; i++)
+    lua.append("function f")
+      .append(std::to_string(i))
+      .append("()\n"
+              "  if x then\n"
+              "    y()\n"
+              "  else\n"
+              "    z()\n"
+              "  end\n"
+              "end\n"
+              "--[[ long\n"
+              "comment ]]\n"
+              "\n");
+  return lua;
+}
+
+void test_refold_lua_edit_is_bounded() {
+  const std::initializer_list<std::pair<const char *, const char *>> props{
+    {"fold", "1"}, {"fold.scintillua.on.zero.sum.lines", "1"}, {"fold.scintillua.compact", "1"}};
+  EditableDocument document{large_lua()};
+  Scintilla::ILexer5 *lexer = create_lexer("lua", props);
+  lex_counting(lexer, document, 0, document.Length());
+  fold_counting(lexer, document, 0, document.Length());
+
+  // Edit a line inside a fold in the middle of the document. Folding stops once the line after
+  // it (and the one after that, since Lua has fold functions) fold to the levels they have.
+  const Sci_Position middle = find(document, "y()", document.Length() / 2);
+  Sci_Position start = document.Replace(middle + 2, 0, "1");
+  lex_counting(lexer, document, start, document.Length() - start);
+  size_t folded = fold_counting(lexer, document, start, document.Length() - start);
+  check(folded > 0 && folded < 64);
+  check_from_scratch("lua", document, props);
+
+  // Edit a zero-sum line and the long comment's fold points.
+  start = document.Replace(find(document, "  else", middle), 6, "  else -- zero-sum");
+  lex_counting(lexer, document, start, document.Length() - start);
+  folded = fold_counting(lexer, document, start, document.Length() - start);
+  check(folded > 0 && folded < 64);
+  check_from_scratch("lua", document, props);
+  start = document.Replace(find(document, "comment ]]", middle), 10, "comment ] ]");
+  lex_counting(lexer, document, start, document.Length() - start);
+  fold_counting(lexer, document, start, document.Length() - start);
+  check_from_scratch("lua", document, props);
+
+  // Edits that change the levels of all lines after them refold them.
+  start = document.Replace(find(document, "function", middle), 0, "if a then\n");
+  lex_counting(lexer, document, start, document.Length() - start);
+  folded = fold_counting(lexer, document, start, document.Length() - start);
+  check(folded >= static_cast<size_t>(document.Length() - start));
+  check_from_scratch("lua", document, props);
+
+  lexer->Release();
+}
+
+// Returns the name of the style the given lexer styled the given position of a document with.
+std::string style_name(Scintilla::ILexer5 *lexer, EditableDocument &document, Sci_Position pos) {
+  return lexer->NameOfStyle(document.StyleAt(pos));
+}
+
+void test_word_lists_are_per_lexer() {
+  EditableDocument document{"foo and\n"};
+  Scintilla::ILexer5 *lexer = create_lexer("lua"), *other = create_lexer("lua");
+  check(lexer->WordListSet(0, "foo") == 1);
+  check(lexer->WordListSet(0, "foo") == -1);
+  lex_counting(lexer, document, 0, document.Length());
+  check(style_name(lexer, document, 0) == "keyword");
+  check(style_name(lexer, document, 4) == "identifier");
+  lex_counting(other, document, 0, document.Length());
+  check(style_name(other, document, 0) == "identifier");
+  check(style_name(other, document, 4) == "keyword");
+
+  // An empty word list clears the lexer's own list rather than restoring it.
+  check(lexer->WordListSet(0, "") == 1);
+  lex_counting(lexer, document, 0, document.Length());
+  check(style_name(lexer, document, 0) == "identifier");
+  check(style_name(lexer, document, 4) == "identifier");
+  lex_counting(other, document, 0, document.Length());
+  check(style_name(other, document, 4) == "keyword");
+
+  lexer->Release(), other->Release();
+}
+
+void test_memory_limit_is_per_lexer() {
+  EditableDocument document{large_lua()};
+  Scintilla::ILexer5 *lexer = create_lexer("lua", {{"lexer.scintillua.memory.limit", "1"}}),
+                     *other = create_lexer("lua");
+  lexer->Lex(0, document.Length(), 0, &document);
+  check(strstr(lexer->PropertyGet("lexer.scintillua.error"), "memory.limit reached") != nullptr);
+  lex_counting(other, document, 0, document.Length());
+  check_from_scratch("lua", document);
+  lexer->Release(), other->Release();
+}
+
+void test_dispatch_does_not_change_styles() {
+  const std::pair<const char *, std::string> documents[] = {
+    {"lua", large_lua()}, {"html", large_html()}};
+  for (const auto &[name, text] : documents) {
+    EditableDocument document{text};
+    Scintilla::ILexer5 *lexer = create_lexer(name, {{"lexer.scintillua.dispatch", "1"}});
+    lex_counting(lexer, document, 0, document.Length());
+    lexer->PropertySet("lexer.scintillua.dispatch", "0");
+    check_from_scratch(name, document);
+    lexer->Release();
+  }
+}
+
+using Properties = std::initializer_list<std::pair<const char *, const char *>>;
+
+// Lexes and folds the given text with the given properties using lexer.lua standalone, as a Lua
+// application would without Scintillua, and returns the fold level lexer.fold() gives each line.
+std::vector<int> lua_levels(const char *name, const std::string &text, Properties props) {
+  static const char *fold = R"(
+    package = {path = 'lexers/?.lua'} -- for the standalone lexer module's property defaults
+    local lexer = dofile('lexers/lexer.lua')
+    local name, text, props = ...
+    local lex = lexer.load(name)
+    for key, value in pairs(props) do lexer.property[key] = value end
+    local tags = lex:lex(text, lex._TAGS['whitespace.' .. lex._name])
+    lexer.style_at = setmetatable({}, {__index = function(_, pos)
+      for i = 2, #tags, 2 do if pos < tags[i] then return tags[i - 1] end end
+    end})
+    return lex:fold(text, 1, lexer.FOLD_BASE)
+  )";
+  lua_State *L = luaL_newstate();
+  luaL_requiref(L, "_G", luaopen_base, 1), lua_pop(L, 1);
+  luaL_requiref(L, LUA_TABLIBNAME, luaopen_table, 1), lua_pop(L, 1);
+  luaL_requiref(L, LUA_STRLIBNAME, luaopen_string, 1), lua_pop(L, 1);
+  luaL_requiref(L, "lpeg", luaopen_lpeg, 1), lua_pop(L, 1);
+  luaL_requiref(L, LUA_MATHLIBNAME, luaopen_math, 1), lua_pop(L, 1);
+  luaL_requiref(L, LUA_UTF8LIBNAME, luaopen_utf8, 1), lua_pop(L, 1);
+  check(luaL_loadstring(L, fold) == LUA_OK);
+  lua_pushstring(L, name), lua_pushlstring(L, text.data(), text.size());
+  lua_createtable(L, 0, props.size());
+  for (const auto &[key, value] : props) lua_pushstring(L, value), lua_setfield(L, -2, key);
+  if (lua_pcall(L, 3, 1, 0) != LUA_OK) fprintf(stderr, "%s\n", lua_tostring(L, -1));
+  check(lua_istable(L, -1));
+  std::vector<int> levels;
+  for (lua_Integer line = 1; lua_geti(L, -1, line) == LUA_TNUMBER; lua_pop(L, 1), line++)
+    levels.push_back(lua_tointeger(L, -1));
+  lua_close(L);
+  return levels;
+}
+
+// Asserts that Scintillua folds the given text with the given lexer and properties to the same
+// levels as lexer.fold() does.
+void check_fold_parity(const char *name, const std::string &text, Properties props) {
+  EditableDocument document{text};
+  Scintilla::ILexer5 *lexer = create_lexer(name, props);
+  lex_counting(lexer, document, 0, document.Length());
+  fold_counting(lexer, document, 0, document.Length());
+  lexer->Release();
+  const std::vector<int> native = levels(document), expected = lua_levels(name, text, props);
+  for (size_t i = 0; i < std::min(native.size(), expected.size()); i++)
+    if (native[i] != expected[i])
+      fprintf(stderr, "%s: line %zu: folded to %#x instead of %#x\n", name, i + 1, native[i],
+        expected[i]);
+  check(native == expected);
+}
+
+void test_fold_parity() {
+  const std::pair<const char *, std::string> documents[] = {
+    {"lua", "-- Comment.\n"
+            "local function f(x)\n"
+            "  if x then\n"
+            "    return {\n"
+            "      a = 1, b = (2 +\n"
+            "        3),\n"
+            "    }\n"
+            "  elseif y then print(1) else\n"
+            "\n"
+            "    print(2)\n"
+            "  end\n"
+            "end\n"
+            "--[[ Long\n"
+            "comment. ]] local s = [[\n"
+            "long string\n"
+            "]]\n"
+            "repeat x() until y for i = 1, 3 do end\n"},
+    {"cpp", "#include <vector>\n"
+            "#ifdef DEBUG\n"
+            "#if 0\n"
+            "#endif\n"
+            "#endif\n"
+            "/* Block\n"
+            "   comment. */\n"
+            "int main() {\n"
+            "  if (x) {\n"
+            "\n"
+            "    y();\n"
+            "  } else {\n"
+            "    z(\"{\", '}'); // {\n"
+            "  }\n"
+            "  return 0; }\n"},
+    {"python", "def f(x):\n"
+               "    if x:\n"
+               "\n"
+               "        return 1\n"
+               "    # comment\n"
+               "    else:\n"
+               "        pass\n"
+               "\n"
+               "class C:\n"
+               "    def g(self):\n"
+               "        return [\n"
+               "            1,\n"
+               "        ]\n"
+               "x = 1\n"},
+    {"html", "<!DOCTYPE html>\n"
+             "<html>\n"
+             "<head>\n"
+             "  <title>Title</title>\n"
+             "  <!-- comment\n"
+             "  spanning lines -->\n"
+             "  <style>\n"
+             "    p { color: red; }\n"
+             "  </style>\n"
+             "  <script>\n"
+             "    function f() {\n"
+             "      return 1 < 2;\n"
+             "    }\n"
+             "  </script>\n"
+             "</head>\n"
+             "<body>\n"
+             "  <p>Text<br/>more<img src=\"x\"></p>\n"
+             "  <div\n"
+             "    class=\"a\">\n"
+             "\n"
+             "    <span>x</span>\n"
+             "  </div>\n"
+             "</body>\n"
+             "</html>\n"}};
+  for (const auto &[name, text] : documents) {
+    check_fold_parity(name, text, {{"fold", "1"}});
+    check_fold_parity(name, text,
+      {{"fold", "1"}, {"fold.scintillua.on.zero.sum.lines", "1"},
+        {"fold.scintillua.compact", "1"}});
+  }
+}
+
+// Returns the styles of the given text lexed from scratch all at once.
+std::vector<char> styles_from_scratch(const char *name, const std::string &text) {
+  EditableDocument fresh{text};
+  Scintilla::ILexer5 *lexer = create_lexer(name, {{"lexer.scintillua.window", "0"}});
+  lex_counting(lexer, fresh, 0, fresh.Length());
+  lexer->Release();
+  return fresh.Styles();
+}
+
+void test_relex_by_line_skips_unchanged_lines() {
+  std::string diff;
+  for (int i = 0; i < 500; i++)
+    diff.append("diff --git a/f b/f\n"
+                "--- a/f\n"
+                "+++ b/f\n"
+                "@@ -1,3 +1,3 @@\n"
+                " context\n"
+                "-old\n"
+                "+new\n");
+  EditableDocument document{diff};
+  Scintilla::ILexer5 *lexer = create_lexer("diff");
+  check(lex_counting(lexer, document, 0, document.Length()) == diff.size());
+
+  // Only the edited line is lexed again, even though lexing resumes before it and the
+  // application asks for the rest of the document.
+  const Sci_Position middle = find(document, "-old", document.Length() / 2);
+  Sci_Position start = document.Replace(middle, 1, "+");
+  check(lex_counting(lexer, document, start, document.Length() - start) == strlen("+old\n"));
+  check_from_scratch("diff", document);
+
+  // Only an inserted line is lexed, since the lines after it have shifted but not changed.
+  start = document.Replace(find(document, " context", middle), 0, "+added\n");
+  check(lex_counting(lexer, document, start, document.Length() - start) == strlen("+added\n"));
+  check_from_scratch("diff", document);
+
+  lexer->Release();
+}
+
+void test_relex_windows() {
+  // Lexing a document larger than a window resumes from a line start in the next one.
+  EditableDocument document{large_html(8000)};
+  check(document.Length() > 1 << 20);
+  Scintilla::ILexer5 *lexer = create_lexer("html");
+  lex_counting(lexer, document, 0, document.Length());
+  check(document.Styles() == styles_from_scratch("html", document.Text()));
+
+  // Edit within a window.
+  const Sci_Position middle = find(document, "var x = 1", document.Length() / 4);
+  Sci_Position start = document.Replace(middle + 8, 1, "2 + 3");
+  size_t lexed = lex_counting(lexer, document, start, document.Length() - start);
+  check(lexed > 0 && lexed < 256);
+  check(document.Styles() == styles_from_scratch("html", document.Text()));
+
+  // Edits whose range spans several windows.
+  lexer->PropertySet("lexer.scintillua.window", "4096");
+  const Sci_Position first = find(document, "<p>", document.Length() / 2);
+  const Sci_Position last = find(document, "</style>", first + 10000);
+  document.Replace(last, 0, "<!-- x -->");
+  start = document.Replace(first, 0, "<b>x</b>");
+  lexed = lex_counting(lexer, document, start, document.Length() - start);
+  const size_t edited = last - first;
+  check(lexed >= edited && lexed < edited + 4096);
+  check(document.Styles() == styles_from_scratch("html", document.Text()));
+
+  lexer->Release();
+}
+
+void test_relex_budget_expiry() {
+  EditableDocument document{large_html(8000)};
+  Scintilla::ILexer5 *lexer =
+    create_lexer("html", {{"lexer.scintillua.budget.ms", "1"}, {"fold", "1"}});
+
+  // Lexing stops part-way at a line start once the budget is exceeded, and leaves the rest of
+  // the range unstyled for the application to lex later, like during idle styling.
+  const auto unstyled = [&]() {
+    const std::vector<char> &styles = document.Styles();
+    return std::find(styles.begin(), styles.end(), 0) - styles.begin();
+  };
+  lex_counting(lexer, document, 0, document.Length());
+  Sci_Position stop = unstyled();
+  check(stop > 0 && stop < document.Length());
+  const Sci_Position stopLine = document.LineFromPosition(stop);
+  check(document.LineStart(stopLine) == stop);
+
+  // Folding does not fold lines that were left unstyled.
+  lexer->Fold(0, document.Length(), 0, &document);
+  const std::vector<int> folded = levels(document);
+  check(std::all_of(folded.begin() + stopLine + 1, folded.end(),
+    [](int level) { return level == SC_FOLDLEVELBASE; }));
+
+  // Each later call styles more of the document.
+  for (int calls = 0; stop < document.Length(); calls++) {
+    check(calls < document.Length() / 4096);
+    lex_counting(lexer, document, stop, document.Length() - stop);
+    const Sci_Position next = unstyled();
+    check(next > stop);
+    stop = next;
+  }
+  check(document.Styles() == styles_from_scratch("html", document.Text()));
+
+  lexer->Release();
+}
+
+void test_lex_documents() {
+  const std::pair<const char *, std::string> texts[] = {{"lua", large_lua()},
+    {"cpp", "#include <stdio.h>\nint main() { return 0; } // comment\n"}, {"html", large_html()},
+    {"nonexistent", "text"}, {"lua", ""}};
+  std::vector<std::vector<char>> styles;
+  std::vector<ScintilluaDocument> documents;
+  for (int i = 0; i < 3; i++)
+    for (const auto &text : texts) styles.emplace_back(text.second.size());
+  for (size_t i = 0; i < styles.size(); i++) {
+    const auto &[name, text] = texts[i % std::size(texts)];
+    documents.push_back({name, text.data(), text.size(), styles[i].data(), -1});
+  }
+  check(LexDocuments(documents.data(), documents.size(), 4) == documents.size() - 3);
+  for (size_t i = 0; i < documents.size(); i++) {
+    const auto &[name, text] = texts[i % std::size(texts)];
+    check(documents[i].ok == (strcmp(name, "nonexistent") != 0));
+    if (documents[i].ok) check(styles[i] == styles_from_scratch(name, text));
+  }
+}
+
+void test_detect_lexers() {
+  ScintilluaFile files[] = {{"foo.lua", nullptr, nullptr}, {"src/foo.cpp", nullptr, nullptr},
+    {nullptr, "#!/bin/sh", nullptr}, {"Makefile", nullptr, nullptr},
+    {"foo.unknown", nullptr, nullptr}, {nullptr, nullptr, nullptr}};
+  const char *expected[] = {"lua", "cpp", "bash", "makefile", nullptr, nullptr};
+  check(DetectLexers(files, std::size(files)) == 4);
+  check(*GetCreateLexerError() == '\0');
+  for (size_t i = 0; i < std::size(files); i++)
+    check(expected[i] ? files[i].lexer && strcmp(files[i].lexer, expected[i]) == 0 :
+                        files[i].lexer == nullptr);
+
+  // Detected lexer names persist.
+  const char *lua = files[0].lexer;
+  check(DetectLexers(files, 1) == 1 && files[0].lexer == lua);
+}
+
+void test_create_lexer_error_is_per_thread() {
+  check(CreateLexer("nonexistent") == nullptr);
+  const std::string error = GetCreateLexerError();
+  check(error.find("no file 'lexers/nonexistent.lua'") != std::string::npos);
+
+  // Another thread sees only its own errors, and does not change this thread's.
+  std::string initial, created, failed;
+  std::thread{[&]() {
+    initial = GetCreateLexerError();
+    Scintilla::ILexer5 *lexer = CreateLexer("lua");
+    created = GetCreateLexerError();
+    if (lexer) lexer->Release();
+    if (!CreateLexer("missing")) failed = GetCreateLexerError();
+  }}.join();
+  check(initial.empty() && created.empty());
+  check(failed.find("no file 'lexers/missing.lua'") != std::string::npos);
+  check(GetCreateLexerError() == error);
+
+  create_lexer("lua")->Release();
+  check(*GetCreateLexerError() == '\0');
+}
+
+// Returns the contents of the given file.
+std::string read_file(const std::filesystem::path &path) {
+  std::string text;
+  FILE *f = fopen(path.string().c_str(), "rb");
+  check(f != nullptr);
+  char buffer[BUFSIZ];
+  for (size_t n; (n = fread(buffer, 1, sizeof(buffer), f)) > 0;) text.append(buffer, n);
+  fclose(f);
+  return text;
+}
+
+// Replaces the contents of the given file.
+void write_file(const std::filesystem::path &path, const std::string &text) {
+  FILE *f = fopen(path.string().c_str(), "wb");
+  check(f != nullptr);
+  check(fwrite(text.data(), 1, text.size(), f) == text.size());
+  fclose(f);
+}
+
+// Returns the 32-bit FNV-1a hash of the given text, as gen_bundle.lua computes it.
+uint32_t fnv1a(const std::string &text) {
+  uint32_t hash = 2166136261u;
+  for (unsigned char ch : text) hash = (hash ^ ch) * 16777619u;
+  return hash;
+}
+
+// Runs gen_bundle.lua in the given directory, which has a "lexers" directory to bundle.
+void gen_bundle(const std::filesystem::path &dir) {
+  const std::filesystem::path cwd = std::filesystem::current_path();
+  const std::string script = (cwd / "gen_bundle.lua").string();
+  lua_State *L = luaL_newstate();
+  luaL_openlibs(L);
+  std::filesystem::current_path(dir);
+  const int status = luaL_dofile(L, script.c_str());
+  std::filesystem::current_path(cwd);
+  if (status != LUA_OK) fprintf(stderr, "%s\n", lua_tostring(L, -1));
+  lua_close(L);
+  check(status == LUA_OK);
+}
+
+void test_bundle_falls_back_on_changed_sources() {
+  namespace fs = std::filesystem;
+  const fs::path root = fs::temp_directory_path() / "scintillua-tests-bundle";
+  fs::remove_all(root);
+  struct Restore {
+    fs::path root;
+    ~Restore() { SetLibraryProperty("scintillua.lexers", "lexers"), fs::remove_all(root); }
+  } restore{root};
+
+  // Bundle a lexer that highlights "foo", and then change its source to highlight "foobar".
+  // The bundled chunk must only be used if its index entry matches the changed source.
+  const auto tiny = [](const char *keyword) {
+    return std::string{"local lexer = lexer\n"
+                       "local lex = lexer.new(...)\n"
+                       "lex:add_rule('keyword', lex:tag(lexer.KEYWORD, lexer.word_match('"} +
+      keyword + "')))\nreturn lex\n";
+  };
+  const std::string bundled = tiny("foo"), changed = tiny("foobar");
+  enum { Stale, Missing, Updated };
+  for (int index : {Stale, Missing, Updated}) {
+    const fs::path dir = root / std::to_string(index), lexers = dir / "lexers";
+    fs::create_directories(lexers);
+    fs::copy_file("lexers/lexer.lua", lexers / "lexer.lua");
+    write_file(lexers / "tiny.lua", bundled);
+    gen_bundle(dir);
+    write_file(lexers / "tiny.lua", changed);
+
+    std::string bundle = read_file(lexers / "lexers.bundle");
+    check(bundle.compare(0, strlen("scintillua bundle 1\n"), "scintillua bundle 1\n") == 0);
+    const size_t entry = bundle.find("\ntiny ") + 1, eol = bundle.find('\n', entry);
+    check(entry > 0 && eol != std::string::npos);
+    unsigned long size, hash, offset, length;
+    check(sscanf(bundle.c_str() + entry, "tiny %lu %lu %lu %lu", &size, &hash, &offset,
+            &length) == 4);
+    check(size == bundled.size() && hash == fnv1a(bundled));
+    if (index == Missing)
+      bundle.erase(entry, eol + 1 - entry);
+    else if (index == Updated) {
+      // Index the changed source so that the chunk that highlights "foo" is used anyway.
+      char line[128];
+      snprintf(line, sizeof(line), "tiny %zu %lu %lu %lu", changed.size(),
+        static_cast<unsigned long>(fnv1a(changed)), offset, length);
+      bundle.replace(entry, eol - entry, line);
+    }
+    write_file(lexers / "lexers.bundle", bundle);
+
+    SetLibraryProperty("scintillua.lexers", lexers.string().c_str());
+    EditableDocument document{"foo foobar\n"};
+    Scintilla::ILexer5 *lexer = create_lexer("tiny");
+    lex_counting(lexer, document, 0, document.Length());
+    check((style_name(lexer, document, 0) == "keyword") == (index == Updated));
+    check((style_name(lexer, document, 4) == "keyword") == (index != Updated));
+    lexer->Release();
+  }
+}
+
+} // namespace
+
+// Run tests.
+int main(int argc, char **argv) {
+  SetLibraryProperty("scintillua.lexers", "lexers");
+  const std::vector<std::pair<std::string, void (*)()>> allTests{
+    {"test_relex_html_edit_is_bounded", test_relex_html_edit_is_bounded},
+    {"test_refold_lua_edit_is_bounded", test_refold_lua_edit_is_bounded},
+    {"test_dispatch_does_not_change_styles", test_dispatch_does_not_change_styles},
+    {"test_fold_parity", test_fold_parity},
+    {"test_relex_by_line_skips_unchanged_lines", test_relex_by_line_skips_unchanged_lines},
+    {"test_relex_windows", test_relex_windows},
+    {"test_relex_budget_expiry", test_relex_budget_expiry},
+    {"test_memory_limit_is_per_lexer", test_memory_limit_is_per_lexer},
+    {"test_word_lists_are_per_lexer", test_word_lists_are_per_lexer},
+    {"test_lex_documents", test_lex_documents},
+    {"test_detect_lexers", test_detect_lexers},
+    {"test_create_lexer_error_is_per_thread", test_create_lexer_error_is_per_thread},
+    {"test_bundle_falls_back_on_changed_sources", test_bundle_falls_back_on_changed_sources},
+  };
+  std::vector<std::pair<std::string, void (*)()>> tests;
+  for (const auto &test : allTests)
+    if (argc == 1 || std::find(argv + 1, argv + argc, test.first) != argv + argc)
+      tests.push_back(test);
+  std::sort(tests.begin(), tests.end());
+  printf("Starting test suite.\n");
+  int failed = 0;
+  for (const auto &[name, test] : tests) {
+    printf("Running %s.\n", name.c_str());
+    try {
+      test();
+    } catch (const std::exception &e) {
+      printf("Failed!\n%s\n", e.what());
+      failed++;
+    }
+  }
+  printf("%d/%d tests passed\n", static_cast<int>(tests.size()) - failed,
+    static_cast<int>(tests.size()));
+  return failed == 0 ? 0 : 1;
+}
@@ -279,6 +279,46 @@ function test_add_tag()
 	assert_lex(lex, code, tags)
 end
 
+-- Tests that rules record statistics while profiling.
+function test_profile()
+	local lex = lexer.new('test')
+	lex:add_rule('keyword', lex:tag(KEYWORD, word_match('foo bar')))
+	local stats = {}
+	lexer._profile = stats -- Scintillua normally creates this when profiling is enabled
+	local ok, err = pcall(assert_lex, lex, 'foo bar', {KEYWORD, 'foo', KEYWORD, 'bar'})
+	lexer._profile = nil
+	assert(ok, err)
+	local attempts, matches, bytes, seconds = table.unpack(stats['test.keyword'])
+	assert(attempts >= 2 and matches == 2 and bytes == 6 and seconds >= 0)
+	assert(stats['test.whitespace'][2] == 1)
+end
+
+-- Tests that first-byte dispatch does not change how lexers lex.
+function test_dispatch()
+	local code = {
+		lua = [[local t = {'foo', "bar", [=[baz]=], 0x1F, -1.5e3} -- comment
+if t then print(#t) elseif not t then t:method() end]],
+		cpp = [[#include <vector>
+std::vector<int> v{1, 2}; // comment
+auto s = u8"str" + L'c' - 0b101 / x;]],
+		html = [[<!DOCTYPE html><p class="a">&amp; text <!-- comment -->
+<style>a { color: #fff; -moz-x: 1px }</style><script>var x = /re/g;</script></p>]]
+	}
+	for name, text in pairs(code) do
+		local lex = lexer.load(name)
+		local expected = lex:lex(text, lex._TAGS['whitespace.' .. name])
+		lexer._dispatch = true -- Scintillua normally sets this when dispatch is enabled
+		local ok, tags = pcall(function()
+			lex = lexer.load(name)
+			return lex:lex(text, lex._TAGS['whitespace.' .. name])
+		end)
+		lexer._dispatch = nil
+		assert(ok, tags)
+		assert(#tags == #expected, name)
+		for i = 1, #tags do assert(tags[i] == expected[i], string.format('%s: %d', name, i)) end
+	end
+end
+
 -- Tests word lists.
 function test_word_list()
 	local lex = lexer.new('test')
@@ -307,6 +347,17 @@ function test_word_list()
 	lex:set_word_list(KEYWORD, {'bar.baz'})
 	tags = {IDENTIFIER, 'foo', KEYWORD, 'bar.baz', IDENTIFIER, 'quux'}
 	assert_lex(lex, code, tags)
+
+	-- Word lists are updated in place without rebuilding the grammar, unless a word starts with
+	-- a character other than a word character.
+	local grammar = lex._grammar
+	lex:set_word_list(KEYWORD, 'foo')
+	assert(lex._grammar_table and lex._grammar == grammar, 'grammar rebuilt')
+	assert_lex(lex, code, {KEYWORD, 'foo', IDENTIFIER, 'bar', OPERATOR, '.', IDENTIFIER, 'baz',
+		IDENTIFIER, 'quux'})
+	lex:set_word_list(KEYWORD, '#foo')
+	assert(not lex._grammar_table, 'grammar not invalidated')
+	assert_lex(lex, '#foo', {KEYWORD, '#foo'})
 end
 
 -- Tests a simple parent lexer embedding a simple child lexer.
@@ -504,6 +555,36 @@ function test_fold_words()
 	assert(levels[4] == lexer.FOLD_BASE)
 end
 
+-- Tests line lookups when using Scintillua as a Lua library.
+function test_standalone_lines()
+	lexer.load('text') -- initializes the standalone library if necessary
+	local lex = lexer.new('test')
+	lex:lex('a\n\tb\n  c') -- sets the text to look up lines in
+	assert(lexer.line_from_position(1) == 1)
+	assert(lexer.line_from_position(2) == 1) -- '\n'
+	assert(lexer.line_from_position(3) == 2)
+	assert(lexer.line_from_position(8) == 3)
+	assert(lexer.line_from_position(100) == 3)
+	assert(lexer.indent_amount[1] == 0)
+	assert(lexer.indent_amount[2] == 8)
+	assert(lexer.indent_amount[3] == 2)
+	assert(lexer.indent_amount[4] == nil)
+end
+
+-- Tests which lexers let Scintillua stop re-lexing at a line that starts in the same state
+-- as before an edit.
+function test_complete_line_state()
+	assert(lexer.new('test', {complete_line_state = true})._complete_line_state)
+	-- Changing a Lua long comment's opening delimiter does not change the style the comment's
+	-- first line ends with or that line's state, but it does change how later lines lex.
+	local lua = lexer.load('lua')
+	assert(not lua._complete_line_state)
+	assert_lex(lua, '--[[\n]==]\nx = 1 --]]', {COMMENT, '--[[\n]==]\nx = 1 --]]'})
+	assert_lex(lua, '--[==[\n]==]\nx = 1 --]]', {
+		COMMENT, '--[==[\n]==]', IDENTIFIER, 'x', OPERATOR, '=', NUMBER, '1', COMMENT, '--]]'
+	})
+end
+
 -- Tests folding by indentation.
 function test_fold_by_indentation()
 	local lex = lexer.new('test', {fold_by_indentation = true})
@@ -1724,6 +1805,18 @@ function test_detect()
 
 	assert(lexer.detect('CMakeLists.txt') == 'cmake') -- not text
 
+	local names = lexer.detect_all{
+		{'foo.lua'}, {'foo.txt'}, {'foo', '#!/bin/sh'}, {nil, '#!/usr/bin/python'}
+	}
+	assert(#names == 4)
+	assert(names[1] == 'lua' and names[2] == false and names[3] == 'bash' and names[4] == 'python')
+
+	lexer.property['lexer.scintillua.detect.cache'] = '1'
+	assert(lexer.detect('foo.lua') == 'lua')
+	assert(lexer._detect_index, 'detection index not cached')
+	assert(lexer.detect('foo', '#!/bin/sh') == 'bash')
+	lexer.property['lexer.scintillua.detect.cache'], lexer._detect_index = '0', nil
+
 	-- Simulate SCI_PRIVATELEXERCALL.
 	assert(not lexer.detect()) -- should not error or anything
 	lexer.property['lexer.scintillua.filename'] = 'foo.lua'